@@ -1,16 +1,39 @@
+#include <atomic>
+#include <cfloat>
+#include <cstddef>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <algorithm>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 #include "SDL.h"
 #include "assimp/cimport.h"
 #include "assimp/postprocess.h"
 #include "assimp/scene.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <sys/stat.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
 using glm::vec2;
 using glm::vec3;
 using glm::vec4;
+using glm::mat4;
 
 struct color {
   uint8_t alpha;
@@ -28,12 +51,129 @@ color ColorRGB(uint8_t red, uint8_t green, uint8_t blue) {
   return c;
 }
 
+const int32_t kMaxSamples = 8;
+
+// Multisampled color and depth. Each pixel keeps up to count distinct
+// fragment colors and a 4 bit slot index per sample, so a pixel covered by a
+// single triangle stores and resolves one color no matter the sample count.
+struct sampleBuffer {
+  // 1 renders straight to the framebuffer, 4 or 8 enable MSAA.
+  int32_t count;
+  // Slot index of sample s in bits 4s to 4s + 3, kEmptySlot for samples
+  // nothing was drawn to.
+  uint32_t* slots;
+  // kMaxSamples slots and depths per pixel.
+  color* colors;
+  float* depth;
+};
+
+const uint32_t kEmptySlot = 0xF;
+
+// Surface attributes Draw() writes in deferred mode for ShadeDeferred() to
+// light, depth is in the depthbuffer.
+struct gBuffer {
+  // Octahedral encoded, 16 bits per coordinate.
+  uint32_t* normals;
+  // Material color, alpha is the specular map or 0 without one.
+  color* albedo;
+  // Specular exponent of the material.
+  uint8_t* shininess;
+};
+
+// Weighted blended order independent transparency. Transparent fragments add
+// their color, weighted by alpha and closeness, to accum and multiply
+// revealage by 1 - alpha, so they need neither sorting nor per pixel lists.
+// ResolveTransparency() composites the weighted average over the opaque
+// framebuffer.
+struct oitBuffer {
+  // Red, green, blue and total weight per pixel.
+  float* accum;
+  // Fraction of the opaque color still visible, 1 where nothing was drawn.
+  float* revealage;
+  // Set when Draw() accumulated fragments since the last resolve.
+  bool pending;
+};
+
+// Bump allocator for data that lives for one frame, 64 byte aligned.
+// Allocations that do not fit spill to the heap, and the next reset grows the
+// arena by what spilled so that steady frames never touch the heap.
+struct arena {
+  uint8_t* base;
+  size_t size;
+  size_t used;
+  // Spilled blocks, each starting with a pointer to the previous one.
+  uint8_t* spill;
+  size_t spilled;
+};
+
+// Worker threads a frame splits work between at most.
+const int32_t kMaxWorkers = 64;
+
+// Transient data of the thread running the frame goes in main, and worker i
+// of RunBands() uses workers[i], so no two threads share an arena.
+struct frameArenas {
+  arena main;
+  arena workers[kMaxWorkers];
+};
+
+// Threads started once by StartWorkers() that RunBands() and RunTiles() hand
+// their work to. Worker i runs band i.
+struct workerPool {
+  std::thread threads[kMaxWorkers];
+  int32_t count;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  // The current job, run by the workers below jobWorkers.
+  void (*run)(void* job, int32_t worker);
+  void* job;
+  int32_t jobWorkers;
+  // Bumped for every job so that each worker runs it once.
+  uint32_t generation;
+  int32_t pending;
+  bool stopping;
+};
+
+// Layouts of the pixels of a render target. RGBA8 is the layout of color,
+// the 8 bit ones are named like the SDL formats they match.
+enum pixelFormat {
+  PIXEL_RGBA8,
+  PIXEL_BGRA8,
+  PIXEL_RGB565,
+  // Red, green, blue and alpha as half or single floats.
+  PIXEL_RGBA16F,
+  PIXEL_RGBA32F,
+};
+
+// Rows of pixels that each start 64 byte aligned, so SIMD loads and stores
+// from the start of a row are aligned.
+struct renderTarget {
+  uint8_t* pixels;
+  int32_t width;
+  int32_t height;
+  // Bytes from one row to the next.
+  size_t pitch;
+  pixelFormat format;
+};
+
 struct screen {
-  color* framebuffer;
-  uint8_t* depthbuffer;
+  // PIXEL_RGBA8, rows are reached through FrameRow().
+  renderTarget* framebuffer;
+  // PIXEL_RGBA32F linear radiance, used when frame::hdr is set.
+  renderTarget* hdr;
+  // Larger is closer, 0 where nothing was drawn.
+  float* depthbuffer;
   int32_t width;
   int32_t height;
   uint8_t depth;
+  sampleBuffer* samples;
+  gBuffer* gbuffer;
+  oitBuffer* oit;
+  // Reset by EventLoop() after every frame.
+  frameArenas* arenas;
+  workerPool* workers;
+  // Of the window texture StoreTarget() writes finished frames to.
+  pixelFormat output;
 };
 
 struct image {
@@ -41,11 +181,379 @@ struct image {
   int32_t x;
   int32_t y;
   int32_t channels;
+  // Why the map could not be loaded, taken on the thread that loaded it.
+  char const* failure;
+};
+
+// Every map of a material at one uv, interleaved so shading a pixel fetches
+// all of them from the same cache line.
+struct texel {
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+  uint8_t alpha;
+  // Normal map, [-1, 1] stored as [0, 255].
+  uint8_t normalX;
+  uint8_t normalY;
+  uint8_t normalZ;
+  uint8_t specular;
+};
+
+enum normalSpace {
+  NORMALS_NONE,
+  NORMALS_TANGENT,
+  NORMALS_OBJECT,
+};
+
+enum assetState {
+  ASSET_LOADING,
+  ASSET_READY,
+  ASSET_FAILED,
+};
+
+// Texels are stored in square tiles this many on a side, so texels that are
+// close vertically share cache lines as well.
+const int32_t kTexelTile = 4;
+
+// A tile of texels block compressed, BC1 for the color and BC4 for every
+// other channel. 48 bytes instead of 128.
+struct textureBlock {
+  uint64_t color;
+  uint64_t alpha;
+  uint64_t normalX;
+  uint64_t normalY;
+  uint64_t normalZ;
+  uint64_t specular;
+};
+
+// Streamed materials are split into square pages this many texels on a side,
+// stored tiled like the texels of a material.
+const int32_t kPageTexels = 128;
+
+// Pages resident at once across every streamed material, 128 KiB each, which
+// is all the texture memory they use besides the coarsest level.
+const int32_t kResidentPages = 128;
+
+// More than the levels of the largest image stb_image loads.
+const int32_t kMaxPageLevels = 24;
+
+// Page-ins UpdatePages() hands to the streamer per frame at most.
+const int32_t kPageInsPerFrame = 16;
+
+// Marks a page in pageTable::slots the streamer is reading.
+const int32_t kPageLoading = -2;
+
+struct pageCache;
+
+// The pages of a streamed material, level 0 first and every level half the
+// size of the previous one down to a single page.
+struct pageTable {
+  FILE* file;
+  int32_t levels;
+  int32_t x[kMaxPageLevels];
+  int32_t y[kMaxPageLevels];
+  int32_t pagesX[kMaxPageLevels];
+  // Index of the first page of every level.
+  int32_t first[kMaxPageLevels];
+  int32_t count;
+  // Resident slot of every page, -1 when it is not resident.
+  std::atomic<int32_t>* slots;
+  // Frame every page was last sampled in, written by SampleMaterial() as
+  // feedback for UpdatePages().
+  std::atomic<uint32_t>* touched;
+  // The last level, always resident so sampling never misses.
+  texel* tail;
+  pageCache* cache;
+};
+
+// A page the streamer reads into the slot UpdatePages() evicted for it.
+struct pageRequest {
+  pageTable* table;
+  int32_t page;
+  int32_t slot;
+};
+
+// Resident pages of every streamed material. Pages are only evicted by
+// UpdatePages() between frames, and the streamer fills evicted slots and
+// publishes them while frames render.
+struct pageCache {
+  texel* texels;
+  pageTable* owner[kResidentPages];
+  int32_t page[kResidentPages];
+  std::atomic<uint32_t> frame;
+  // Runs StreamPages() for as long as the cache lives.
+  std::thread streamer;
+  std::mutex lock;
+  std::condition_variable wake;
+  // Set while the streamer owns the requests, UpdatePages() only writes
+  // them when it is clear.
+  std::atomic<bool> streaming;
+  bool stopping;
+  pageRequest requests[kPageInsPerFrame];
+  int32_t requestCount;
+};
+
+struct material {
+  // Tiles of kTexelTile x kTexelTile texels in row order, 64 byte aligned.
+  texel* texels;
+  // The same tiles compressed, instead of texels.
+  textureBlock* blocks;
+  // Streamed in pages, instead of texels.
+  pageTable* pages;
+  // Size of the cache file the texels or blocks are mapped from, 0 when they
+  // were allocated.
+  size_t mapped;
+  int32_t x;
+  int32_t y;
+  normalSpace normals;
+  bool specular;
+  float shininess;
+  // Multiplies the alpha of the diffuse map.
+  float opacity;
+  // Drawn after opaque geometry with blending, set when the opacity or any
+  // texel alpha is below 1.
+  bool transparent;
+  // Textures are decoded on worker threads, the texels may only be used once
+  // this is ASSET_READY.
+  std::atomic<assetState> state;
+};
+
+enum lightType {
+  LIGHT_AMBIENT,
+  LIGHT_DIRECTIONAL,
+  LIGHT_POINT,
+  LIGHT_SPOT,
+};
+
+struct light {
+  lightType type;
+  vec3 color;
+  vec3 position;   // Point and spot lights, model space.
+  vec3 direction;  // Directional and spot lights, the way the light travels.
+  float range;     // Point and spot lights, distance where it fades to zero.
+  float innerCone;  // Spot lights, half angles in radians.
+  float outerCone;
+  bool castsShadow;  // Directional and spot lights.
+};
+
+const int32_t kMaxLights = 16;
+
+// Lights stored as structure of arrays. Every light type is expressed with the
+// same arithmetic (see SetLights) so EvaluateLights() is a branch-free loop the
+// compiler can vectorize across lights.
+struct lightSet {
+  int32_t count;
+  // Bumped every time the lights change, cached light terms compare against
+  // it to know when they are stale.
+  uint32_t version;
+  float colorR[kMaxLights];
+  float colorG[kMaxLights];
+  float colorB[kMaxLights];
+  // Direction to the light is (x, y, z) - positional * p.
+  float x[kMaxLights];
+  float y[kMaxLights];
+  float z[kMaxLights];
+  float positional[kMaxLights];
+  float ambient[kMaxLights];
+  float invRangeSq[kMaxLights];
+  float spotX[kMaxLights];
+  float spotY[kMaxLights];
+  float spotZ[kMaxLights];
+  float cosOuter[kMaxLights];
+  float invConeWidth[kMaxLights];
+  // 1 for lights whose contribution is not attenuated by a shadow map.
+  float unshadowed[kMaxLights];
+};
+
+const int32_t kMaxShadowMaps = 2;
+
+// Depth of the scene as seen from a light, rendered by ShadowPass().
+struct shadowMap {
+  float* depth;
+  int32_t size;
+  // Index of the light in the light set, -1 when the map is unused.
+  int32_t light;
+  uint32_t version;
+  // Model space to shadow map texels, z is the depth stored in the map.
+  mat4 transform;
+};
+
+enum rasterMode {
+  // Bounding box walked in 8x8 blocks, best for large triangles.
+  RASTER_BLOCKS,
+  // Exact span per row, never visits a pixel outside the triangle.
+  RASTER_SCANLINE,
+  // Picks one of the above per triangle from how much of its bounding box it
+  // covers.
+  RASTER_AUTO,
+};
+
+enum shadingMode {
+  SHADE_FACE,
+  SHADE_VERTEX,
+  SHADE_PIXEL,
 };
 
+// Effects PostProcess() can apply to the finished framebuffer.
+enum postType {
+  POST_TONEMAP,
+  POST_GAMMA,
+  POST_GRADE,
+  POST_VIGNETTE,
+  POST_SHARPEN
+};
+
+struct postPass {
+  postType type;
+  // Exposure of POST_TONEMAP, gamma of POST_GAMMA, saturation of POST_GRADE
+  // and strength of POST_VIGNETTE and POST_SHARPEN.
+  float amount;
+  // Per channel gain of POST_GRADE.
+  vec3 tint;
+};
+
+const int32_t kMaxPostPasses = 8;
+
+// Passes applied in order to the finished framebuffer by PostProcess().
+struct postChain {
+  int32_t count;
+  postPass passes[kMaxPostPasses];
+};
+
+// Per frame rendering inputs.
+struct frame {
+  lightSet const* lights;
+  shadingMode shading;
+  rasterMode raster;
+  shadowMap* shadowMaps;
+  int32_t shadowMapCount;
+  // Shadow lookups average (2 * pcf + 1)^2 texels, 0 gives hard shadows.
+  int32_t pcf;
+  postChain const* post;
+  bool postProcess;
+  // Smooths edges of the finished framebuffer with Antialias().
+  bool antialias;
+  // Darkens crevices with AmbientOcclusion() before post processing.
+  bool ambientOcclusion;
+  float ambientOcclusionStrength;
+  // Rasterizes into the G-buffer and lights it with ShadeDeferred().
+  bool deferred;
+  // Renders with RayTrace() instead of rasterizing.
+  bool rayTrace;
+  // Occlusion rays per pixel that scale ambient lights when ray tracing.
+  int32_t aoRays;
+  // Shades linear radiance into screen->hdr, which ResolveHdr() tone maps
+  // into the framebuffer. MSAA and transparent surfaces are tone mapped as
+  // they are shaded instead.
+  bool hdr;
+  // Scales radiance before tone mapping.
+  float exposure;
+};
+
+// Light terms per face or per vertex, reused across frames while the lights
+// do not change.
+struct lightCache {
+  uint32_t version;
+  shadingMode shading;
+  std::vector<vec3> terms;
+};
+
+struct bvhNode {
+  vec3 low;
+  vec3 high;
+  // First item of a leaf, or the second child of an inner node whose first
+  // child follows it.
+  uint32_t offset;
+  // Items of a leaf, 0 for inner nodes.
+  uint32_t count;
+};
+
+// Bounding volume hierarchy with its nodes flattened in depth first order.
+// Items are indices into whatever the hierarchy was built over, those of a
+// leaf are contiguous.
+struct bvh {
+  std::vector<bvhNode> nodes;
+  std::vector<uint32_t> items;
+};
+
+// A run of consecutive faces of a mesh, bounded so that Draw() can skip it
+// as a whole.
+struct meshlet {
+  uint32_t firstFace;
+  uint32_t faceCount;
+  vec3 center;
+  float radius;
+  // Every face normal is within the cone around axis, which faces away from
+  // the viewer when axis.z < cutoff.
+  vec3 axis;
+  float cutoff;
+};
+
+// Faces and meshlets of one level of detail. All levels share the vertices
+// of the mesh, coarser ones follow the full one in its indices and meshlets.
+struct meshLod {
+  uint32_t firstFace;
+  uint32_t faceCount;
+  uint32_t firstMeshlet;
+  uint32_t meshletCount;
+  // Estimated distance to the full mesh in model units.
+  float error;
+  // Over the meshlets of this level, items are relative to firstMeshlet.
+  bvh meshletBvh;
+};
+
+// A mesh of the scene with its node transforms applied, vertices are in model
+// space.
+struct mesh {
+  std::vector<vec3> positions;
+  std::vector<vec3> normals;
+  std::vector<vec3> tangents;
+  std::vector<vec3> bitangents;
+  std::vector<vec2> uvs;
+  // Three per triangle.
+  std::vector<uint32_t> indices;
+  std::vector<meshlet> meshlets;
+  // Full detail first.
+  std::vector<meshLod> lods;
+  // Over the faces of the full level.
+  bvh faceBvh;
+  material* material;
+  lightCache lightCache;
+};
+
+// Assets are loaded on worker threads, the scene fields may only be used once
+// sceneState is ASSET_READY.
 struct resources {
-  aiScene const* scene;
-  image* image;
+  std::atomic<assetState> sceneState;
+  // Every mesh instance of the scene, sorted by material.
+  std::vector<mesh> meshes;
+  // One per scene material.
+  material* materials;
+  int32_t materialCount;
+  // Named after the model, used by materials without their own textures. It
+  // starts loading at the same time as the scene.
+  material* fallback;
+  // Drawn with while a material loads.
+  material* placeholder;
+  // Keeps textures block compressed and decodes them as they are sampled.
+  bool compressTextures;
+  // Streams textures in pages when set.
+  pageCache* pages;
+  // Distance from the origin to the farthest vertex.
+  float radius;
+  // Over the meshes.
+  bvh meshBvh;
+};
+
+// Attributes interpolated across a triangle.
+struct vertex {
+  vec3 screen;
+  vec3 position;
+  vec3 normal;
+  vec3 tangent;
+  vec3 bitangent;
+  vec2 uv;
+  vec3 light;
 };
 
 void Initialize(SDL_Window** window,
@@ -53,205 +561,4942 @@ void Initialize(SDL_Window** window,
                 SDL_Texture** texture,
                 screen* screen);
 
-vec4 BoundingBox(vec3 v1, vec3 v2, vec3 v3) {
-  float minx = std::min(v1.x, std::min(v2.x, v3.x));
-  float miny = std::min(v1.y, std::min(v2.y, v3.y));
-  float maxx = std::max(v1.x, std::max(v2.x, v3.x));
-  float maxy = std::max(v1.y, std::max(v2.y, v3.y));
+void UpdatePages(resources* resources);
 
-  return vec4(minx, miny, maxx, maxy);
+void* ArenaAlloc(arena* arena, size_t bytes) {
+  bytes = (bytes + 63) / 64 * 64;
+  if (arena->used + bytes <= arena->size) {
+    void* memory = arena->base + arena->used;
+    arena->used += bytes;
+    return memory;
+  }
+  uint8_t* block = (uint8_t*)aligned_alloc(64, 64 + bytes);
+  *(uint8_t**)block = arena->spill;
+  arena->spill = block;
+  arena->spilled += bytes;
+  return block + 64;
 }
 
-vec3 Baricenter(vec3 p, vec3 v1, vec3 v2, vec3 v3) {
-  vec3 v31 = v1 - v3;
-  vec3 v32 = v2 - v3;
-  vec3 pv3 = v3 - p;
+// Uninitialized, for trivial types only.
+template <typename T>
+T* ArenaArray(arena* arena, size_t count) {
+  return (T*)ArenaAlloc(arena, count * sizeof(T));
+}
 
-  vec3 x = vec3(v31.x, v32.x, pv3.x);
-  vec3 y = vec3(v31.y, v32.y, pv3.y);
-  vec3 cross = glm::cross(x, y);
+// Frees everything allocated since the last reset.
+void ResetArena(arena* arena) {
+  while (arena->spill) {
+    uint8_t* previous = *(uint8_t**)arena->spill;
+    free(arena->spill);
+    arena->spill = previous;
+  }
+  if (arena->spilled) {
+    free(arena->base);
+    arena->size += arena->spilled;
+    arena->base = (uint8_t*)aligned_alloc(64, arena->size);
+  }
+  arena->used = 0;
+  arena->spilled = 0;
+}
 
-  float u = cross.x / cross.z;
-  float v = cross.y / cross.z;
+void ResetFrameArenas(frameArenas* arenas) {
+  ResetArena(&arenas->main);
+  for (arena& worker : arenas->workers)
+    ResetArena(&worker);
+}
 
-  return vec3(u, v, 1.f - u - v);
+size_t PixelBytes(pixelFormat format) {
+  switch (format) {
+    case PIXEL_RGB565:
+      return 2;
+    case PIXEL_RGBA16F:
+      return 8;
+    case PIXEL_RGBA32F:
+      return 16;
+    default:
+      return 4;
+  }
 }
 
-bool PointInTriangle(vec3 baricenter) {
-  return baricenter.x >= 0 && baricenter.y >= 0 &&
-         baricenter.x + baricenter.y <= 1.f;
+// Rows hold at least padding pixels past the width and are rounded up to a
+// multiple of 64 bytes.
+void CreateRenderTarget(renderTarget* target,
+                        int32_t width,
+                        int32_t height,
+                        pixelFormat format,
+                        int32_t padding) {
+  target->width = width;
+  target->height = height;
+  target->format = format;
+  target->pitch = ((width + padding) * PixelBytes(format) + 63) / 64 * 64;
+  target->pixels = (uint8_t*)aligned_alloc(64, target->pitch * height);
 }
 
-void DrawTriangle(screen* screen,
-                  vec3 v1,
-                  vec3 v2,
-                  vec3 v3,
-                  vec3 normal,
-                  vec2 t1,
-                  vec2 t2,
-                  vec2 t3,
-                  image* image) {
-  vec4 bbox = BoundingBox(v1, v2, v3);
-  float minx = bbox[0];
-  float miny = bbox[1];
-  float maxx = bbox[2];
-  float maxy = bbox[3];
-  vec3 lightDir(0, 0, 1);
-
-  float magnitude = -glm::dot(lightDir, normal);
-  if (magnitude < 0.f)
-    return;
+void FreeRenderTarget(renderTarget* target) {
+  free(target->pixels);
+  target->pixels = 0;
+}
+
+void ClearTarget(renderTarget* target) {
+  memset(target->pixels, 0x00, target->pitch * target->height);
+}
+
+uint8_t* TargetRow(renderTarget const* target, int32_t y) {
+  return target->pixels + y * target->pitch;
+}
+
+color* FrameRow(screen const* screen, int32_t y) {
+  return (color*)TargetRow(screen->framebuffer, y);
+}
+
+void FreeFrameArenas(frameArenas* arenas) {
+  ResetFrameArenas(arenas);
+  free(arenas->main.base);
+  for (arena& worker : arenas->workers)
+    free(worker.base);
+}
+
+// Vertices are snapped to 28.4 fixed point so coverage is decided with exact
+// integer edge functions.
+const int32_t kSubpixelBits = 4;
+const int64_t kSubpixelOne = 1 << kSubpixelBits;
+const int64_t kSubpixelHalf = kSubpixelOne / 2;
+
+int64_t FixedPoint(float v) {
+  // Keeps far off screen vertices from overflowing the edge functions.
+  const float kGuardBand = 1 << 24;
+  return std::lround(std::min(kGuardBand, std::max(-kGuardBand, v)) *
+                     kSubpixelOne);
+}
+
+// Integer edge functions of a triangle over its clipped bounding box. Edge i
+// is opposite vertex i and its function is the weight of vertex i times twice
+// the area.
+struct edgeSetup {
+  int32_t minx;
+  int32_t miny;
+  int32_t maxx;
+  int32_t maxy;
+  // Edge functions at the center of pixel (minx, miny).
+  int64_t origin[3];
+  // Change of the edge functions one pixel right and one pixel up.
+  int64_t stepX[3];
+  int64_t stepY[3];
+  // Edges that are not top or left are biased by -1 so centers exactly on
+  // them fail the >= 0 test.
+  int64_t bias[3];
+  int64_t area;
+  float invArea;
+  // Clockwise triangles are set up with two vertices swapped, their weights
+  // are swapped back before calling fragment.
+  bool flipped;
+};
+
+// Returns false when the triangle covers no pixel center of the target, or no
+// point within reach subpixels of one.
+bool SetupEdges(int32_t width,
+                int32_t height,
+                vec3 v1,
+                vec3 v2,
+                vec3 v3,
+                int64_t reach,
+                edgeSetup* setup) {
+  int64_t x[3] = {FixedPoint(v1.x), FixedPoint(v2.x), FixedPoint(v3.x)};
+  int64_t y[3] = {FixedPoint(v1.y), FixedPoint(v2.y), FixedPoint(v3.y)};
+  int64_t area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+  if (area == 0)
+    return false;
+  setup->flipped = area < 0;
+  if (setup->flipped) {
+    std::swap(x[1], x[2]);
+    std::swap(y[1], y[2]);
+    area = -area;
+  }
+  setup->area = area;
+  setup->invArea = 1.f / area;
 
-  for (int32_t y = miny; y <= maxy; y++) {
-    for (int32_t x = minx; x <= maxx; x++) {
-      vec3 baricenter = Baricenter(vec3(x, y, 1), v1, v2, v3);
-      if (PointInTriangle(baricenter)) {
-        float pointz =
-            v1.z * baricenter.x + v2.z * baricenter.y + v3.z * baricenter.z;
-        uint8_t* pixelDepth = screen->depthbuffer + (x + y * screen->width);
-        if (pointz > *pixelDepth) {
-          *pixelDepth = pointz;
-          vec2 textureCoords =
-              t1 * baricenter.x + t2 * baricenter.y + t3 * baricenter.z;
-          glm::ivec2 screenTextCoords(textureCoords.x * image->x,
-                                      (1.f - textureCoords.y) * image->y);
-
-          uint8_t const* pixelData =
-              &image->buffer[image->channels * (screenTextCoords.x +
-                                                image->x * screenTextCoords.y)];
-          color color = ColorRGB(pixelData[0], pixelData[1], pixelData[2]);
-          screen->framebuffer[x + y * screen->width] =
-              ColorRGB((uint8_t)(magnitude * color.red),
-                       (uint8_t)(magnitude * color.green),
-                       (uint8_t)(magnitude * color.blue));
+  // Pixels whose center is inside the bounding box, clipped to the target.
+  auto firstPixel = [](int64_t v) {
+    return (int32_t)((v - kSubpixelHalf + kSubpixelOne - 1) >> kSubpixelBits);
+  };
+  auto lastPixel = [](int64_t v) {
+    return (int32_t)((v - kSubpixelHalf) >> kSubpixelBits);
+  };
+  setup->minx =
+      std::max(0, firstPixel(std::min({x[0], x[1], x[2]}) - reach));
+  setup->miny =
+      std::max(0, firstPixel(std::min({y[0], y[1], y[2]}) - reach));
+  setup->maxx =
+      std::min(width - 1, lastPixel(std::max({x[0], x[1], x[2]}) + reach));
+  setup->maxy =
+      std::min(height - 1, lastPixel(std::max({y[0], y[1], y[2]}) + reach));
+  if (setup->minx > setup->maxx || setup->miny > setup->maxy)
+    return false;
+
+  for (int32_t i = 0; i < 3; i++) {
+    int32_t a = (i + 1) % 3;
+    int32_t b = (i + 2) % 3;
+    int64_t ex = x[b] - x[a];
+    int64_t ey = y[b] - y[a];
+    bool topLeft = ey < 0 || (ey == 0 && ex < 0);
+    setup->bias[i] = topLeft ? 0 : -1;
+    setup->stepX[i] = -ey * kSubpixelOne;
+    setup->stepY[i] = ex * kSubpixelOne;
+    int64_t px = setup->minx * kSubpixelOne + kSubpixelHalf;
+    int64_t py = setup->miny * kSubpixelOne + kSubpixelHalf;
+    setup->origin[i] = ex * (py - y[a]) - ey * (px - x[a]) + setup->bias[i];
+  }
+  return true;
+}
+
+int64_t EdgeAt(edgeSetup const* setup, int32_t i, int32_t x, int32_t y) {
+  return setup->origin[i] + (x - setup->minx) * setup->stepX[i] +
+         (y - setup->miny) * setup->stepY[i];
+}
+
+template <typename Fragment>
+void EmitFragment(edgeSetup const* setup,
+                  int32_t x,
+                  int32_t y,
+                  int64_t e0,
+                  int64_t e1,
+                  int64_t e2,
+                  Fragment& fragment) {
+  float w0 = (e0 - setup->bias[0]) * setup->invArea;
+  float w1 = (e1 - setup->bias[1]) * setup->invArea;
+  float w2 = (e2 - setup->bias[2]) * setup->invArea;
+  fragment(x, y, setup->flipped ? vec3(w0, w2, w1) : vec3(w0, w1, w2));
+}
+
+// Walks the bounding box in aligned blocks. Edge functions are linear so their
+// extremes over a block are at its corners: blocks outside an edge are
+// skipped, blocks inside every edge are filled without testing pixels and
+// only blocks crossed by an edge test each pixel.
+template <typename Fragment>
+void RasterizeBlocks(edgeSetup const* setup, Fragment& fragment) {
+  const int32_t kBlockSize = 8;
+  for (int32_t by = setup->miny & ~(kBlockSize - 1); by <= setup->maxy;
+       by += kBlockSize) {
+    int32_t y0 = std::max(by, setup->miny);
+    int32_t y1 = std::min(by + kBlockSize - 1, setup->maxy);
+    for (int32_t bx = setup->minx & ~(kBlockSize - 1); bx <= setup->maxx;
+         bx += kBlockSize) {
+      int32_t x0 = std::max(bx, setup->minx);
+      int32_t x1 = std::min(bx + kBlockSize - 1, setup->maxx);
+
+      bool outside = false;
+      bool inside = true;
+      int64_t row[3];
+      for (int32_t i = 0; i < 3; i++) {
+        row[i] = EdgeAt(setup, i, x0, y0);
+        int64_t spanX = (x1 - x0) * setup->stepX[i];
+        int64_t spanY = (y1 - y0) * setup->stepY[i];
+        int64_t lowest =
+            row[i] + std::min<int64_t>(0, spanX) + std::min<int64_t>(0, spanY);
+        int64_t highest =
+            row[i] + std::max<int64_t>(0, spanX) + std::max<int64_t>(0, spanY);
+        outside |= highest < 0;
+        inside &= lowest >= 0;
+      }
+      if (outside)
+        continue;
+
+      for (int32_t y = y0; y <= y1; y++) {
+        int64_t e0 = row[0];
+        int64_t e1 = row[1];
+        int64_t e2 = row[2];
+        for (int32_t x = x0; x <= x1; x++) {
+          if (inside || (e0 | e1 | e2) >= 0)
+            EmitFragment(setup, x, y, e0, e1, e2, fragment);
+          e0 += setup->stepX[0];
+          e1 += setup->stepX[1];
+          e2 += setup->stepX[2];
         }
+        row[0] += setup->stepY[0];
+        row[1] += setup->stepY[1];
+        row[2] += setup->stepY[2];
       }
     }
   }
 }
 
-void Destroy(screen* screen,
-             SDL_Window* window,
-             SDL_Renderer* renderer,
-             SDL_Texture* texture);
+// Solves every edge function for the exact run of pixels each row covers, so
+// no pixel outside the triangle is visited. Covers the same pixels as
+// RasterizeBlocks().
+template <typename Fragment>
+void RasterizeScanlines(edgeSetup const* setup, Fragment& fragment) {
+  auto ceilDiv = [](int64_t a, int64_t b) {
+    return a / b + ((a % b != 0) && ((a < 0) == (b < 0)));
+  };
+  auto floorDiv = [](int64_t a, int64_t b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+  };
 
-vec3 convertGlm(aiVector3D vec) {
-  return vec3(vec.x, vec.y, vec.z);
+  int64_t row[3] = {setup->origin[0], setup->origin[1], setup->origin[2]};
+  for (int32_t y = setup->miny; y <= setup->maxy; y++) {
+    // Offsets from minx where e + offset * stepX >= 0 for every edge.
+    int64_t first = 0;
+    int64_t last = setup->maxx - setup->minx;
+    for (int32_t i = 0; i < 3; i++) {
+      int64_t step = setup->stepX[i];
+      if (step > 0)
+        first = std::max(first, ceilDiv(-row[i], step));
+      else if (step < 0)
+        last = std::min(last, floorDiv(row[i], -step));
+      else if (row[i] < 0)
+        last = -1;
+    }
+
+    int64_t e0 = row[0] + first * setup->stepX[0];
+    int64_t e1 = row[1] + first * setup->stepX[1];
+    int64_t e2 = row[2] + first * setup->stepX[2];
+    for (int64_t offset = first; offset <= last; offset++) {
+      EmitFragment(setup, setup->minx + offset, y, e0, e1, e2, fragment);
+      e0 += setup->stepX[0];
+      e1 += setup->stepX[1];
+      e2 += setup->stepX[2];
+    }
+    row[0] += setup->stepY[0];
+    row[1] += setup->stepY[1];
+    row[2] += setup->stepY[2];
+  }
+}
+
+// Calls fragment(x, y, baricenter) for every pixel of a width x height target
+// whose center the triangle covers. Pixel centers exactly on an edge belong
+// to the triangle only for top and left edges, so pixels along an edge shared
+// by two triangles are drawn once. Shared by the color and the depth-only
+// passes.
+template <typename Fragment>
+void RasterizeTriangle(int32_t width,
+                       int32_t height,
+                       vec3 v1,
+                       vec3 v2,
+                       vec3 v3,
+                       rasterMode mode,
+                       Fragment fragment) {
+  edgeSetup setup;
+  if (!SetupEdges(width, height, v1, v2, v3, 0, &setup))
+    return;
+
+  if (mode == RASTER_AUTO) {
+    // Slivers cover little of their bounding box, most blocks would only be
+    // visited to be rejected.
+    const float kScanlineCoverage = 0.25f;
+    float box =
+        (setup.maxx - setup.minx + 1.f) * (setup.maxy - setup.miny + 1.f);
+    float pixels = setup.area / (2.f * kSubpixelOne * kSubpixelOne);
+    mode = pixels < kScanlineCoverage * box ? RASTER_SCANLINE : RASTER_BLOCKS;
+  }
+  if (mode == RASTER_SCANLINE)
+    RasterizeScanlines(&setup, fragment);
+  else
+    RasterizeBlocks(&setup, fragment);
 }
 
-void Draw(screen* screen, resources* resources) {
-  aiMesh const* mesh = resources->scene->mMeshes[0];
+// Sample offsets from the pixel center in subpixels, the standard 4x and 8x
+// patterns.
+struct samplePattern {
+  int32_t count;
+  int8_t x[kMaxSamples];
+  int8_t y[kMaxSamples];
+};
 
-  for (size_t i = 0; i < mesh->mNumFaces; i++) {
-    aiFace face = mesh->mFaces[i];
+const samplePattern kSamplePatterns[] = {
+    {4, {-2, 6, -6, 2}, {-6, -2, 2, 6}},
+    {8, {1, -1, 5, -3, -5, -7, 3, 7}, {-3, 3, 1, -5, 5, -1, -7, 7}},
+};
 
-    vec3 v1_model = convertGlm(mesh->mVertices[face.mIndices[0]]);
-    vec3 v1_screen = vec3((v1_model.x + 1.f) * screen->width / 2.f,
-                          (v1_model.y + 1.f) * screen->height / 2.f,
-                          (v1_model.z + 1.f) * screen->depth / 2.f);
+samplePattern const* SamplePattern(int32_t count) {
+  return &kSamplePatterns[count == 4 ? 0 : 1];
+}
 
-    vec3 v2_model = convertGlm(mesh->mVertices[face.mIndices[1]]);
-    vec3 v2_screen = vec3((v2_model.x + 1.f) * screen->width / 2.f,
-                          (v2_model.y + 1.f) * screen->height / 2.f,
-                          (v2_model.z + 1.f) * screen->depth / 2.f);
+// Calls fragment(x, y, baricenter, coverage) once for every pixel with at
+// least one covered sample, baricenter is at the pixel center and bit s of
+// coverage is set when sample s is inside the triangle. Uses the same blocks
+// and fill rule as RasterizeBlocks().
+template <typename Fragment>
+void RasterizeTriangleSamples(int32_t width,
+                              int32_t height,
+                              vec3 v1,
+                              vec3 v2,
+                              vec3 v3,
+                              samplePattern const* pattern,
+                              Fragment fragment) {
+  edgeSetup setup;
+  if (!SetupEdges(width, height, v1, v2, v3, kSubpixelHalf, &setup))
+    return;
 
-    vec3 v3_model = convertGlm(mesh->mVertices[face.mIndices[2]]);
-    vec3 v3_screen = vec3((v3_model.x + 1.f) * screen->width / 2.f,
-                          (v3_model.y + 1.f) * screen->height / 2.f,
-                          (v3_model.z + 1.f) * screen->depth / 2.f);
+  // Edge function offsets of every sample from the pixel center.
+  int64_t offsets[3][kMaxSamples];
+  int64_t reach[3];
+  for (int32_t i = 0; i < 3; i++) {
+    int64_t dx = setup.stepX[i] / kSubpixelOne;
+    int64_t dy = setup.stepY[i] / kSubpixelOne;
+    for (int32_t s = 0; s < pattern->count; s++)
+      offsets[i][s] = pattern->x[s] * dx + pattern->y[s] * dy;
+    reach[i] = (std::abs(setup.stepX[i]) + std::abs(setup.stepY[i])) / 2;
+  }
+  uint32_t full = (1u << pattern->count) - 1;
 
-    vec3 normal =
-        glm::normalize(glm::cross(v3_model - v1_model, v2_model - v1_model));
+  const int32_t kBlockSize = 8;
+  for (int32_t by = setup.miny & ~(kBlockSize - 1); by <= setup.maxy;
+       by += kBlockSize) {
+    int32_t y0 = std::max(by, setup.miny);
+    int32_t y1 = std::min(by + kBlockSize - 1, setup.maxy);
+    for (int32_t bx = setup.minx & ~(kBlockSize - 1); bx <= setup.maxx;
+         bx += kBlockSize) {
+      int32_t x0 = std::max(bx, setup.minx);
+      int32_t x1 = std::min(bx + kBlockSize - 1, setup.maxx);
 
-    vec2 t1 = vec2(mesh->mTextureCoords[0][face.mIndices[0]].x,
-                   mesh->mTextureCoords[0][face.mIndices[0]].y);
-    vec2 t2 = vec2(mesh->mTextureCoords[0][face.mIndices[1]].x,
-                   mesh->mTextureCoords[0][face.mIndices[1]].y);
-    vec2 t3 = vec2(mesh->mTextureCoords[0][face.mIndices[2]].x,
-                   mesh->mTextureCoords[0][face.mIndices[2]].y);
+      // Block extremes widened by half a pixel to account for the samples.
+      bool outside = false;
+      bool inside = true;
+      int64_t row[3];
+      for (int32_t i = 0; i < 3; i++) {
+        row[i] = EdgeAt(&setup, i, x0, y0);
+        int64_t spanX = (x1 - x0) * setup.stepX[i];
+        int64_t spanY = (y1 - y0) * setup.stepY[i];
+        int64_t lowest = row[i] + std::min<int64_t>(0, spanX) +
+                         std::min<int64_t>(0, spanY) - reach[i];
+        int64_t highest = row[i] + std::max<int64_t>(0, spanX) +
+                          std::max<int64_t>(0, spanY) + reach[i];
+        outside |= highest < 0;
+        inside &= lowest >= 0;
+      }
+      if (outside)
+        continue;
 
-    DrawTriangle(screen, v1_screen, v2_screen, v3_screen, normal, t1, t2, t3,
-                 resources->image);
+      for (int32_t y = y0; y <= y1; y++) {
+        int64_t e[3] = {row[0], row[1], row[2]};
+        for (int32_t x = x0; x <= x1; x++) {
+          uint32_t coverage = full;
+          if (!inside) {
+            coverage = 0;
+            for (int32_t s = 0; s < pattern->count; s++) {
+              bool covered = ((e[0] + offsets[0][s]) | (e[1] + offsets[1][s]) |
+                              (e[2] + offsets[2][s])) >= 0;
+              coverage |= covered << s;
+            }
+          }
+          if (coverage) {
+            float w0 = (e[0] - setup.bias[0]) * setup.invArea;
+            float w1 = (e[1] - setup.bias[1]) * setup.invArea;
+            float w2 = (e[2] - setup.bias[2]) * setup.invArea;
+            fragment(x, y, setup.flipped ? vec3(w0, w2, w1) : vec3(w0, w1, w2),
+                     coverage);
+          }
+          for (int32_t i = 0; i < 3; i++)
+            e[i] += setup.stepX[i];
+        }
+        for (int32_t i = 0; i < 3; i++)
+          row[i] += setup.stepY[i];
+      }
+    }
   }
 }
 
-void EventLoop(screen* screen,
-               resources* resources,
-               SDL_Renderer* renderer,
-               SDL_Texture* texture) {
-  bool running = true;
-  while (running) {
-    SDL_Event event;
-    while (SDL_PollEvent(&event)) {
-      switch (event.type) {
-        case SDL_QUIT:
-          running = false;
+void SetLights(lightSet* set, light const* lights, int32_t count) {
+  set->count = std::min(count, kMaxLights);
+  set->version++;
+  int32_t shadowedCount = 0;
+  for (int32_t i = 0; i < set->count; i++) {
+    light const& l = lights[i];
+    set->colorR[i] = l.color.x;
+    set->colorG[i] = l.color.y;
+    set->colorB[i] = l.color.z;
+
+    bool positional = l.type == LIGHT_POINT || l.type == LIGHT_SPOT;
+    vec3 toLight = positional ? l.position : -glm::normalize(l.direction);
+    if (l.type == LIGHT_AMBIENT)
+      toLight = vec3(0, 0, 1);
+    set->x[i] = toLight.x;
+    set->y[i] = toLight.y;
+    set->z[i] = toLight.z;
+    set->positional[i] = positional ? 1.f : 0.f;
+    set->ambient[i] = l.type == LIGHT_AMBIENT ? 1.f : 0.f;
+    set->invRangeSq[i] = positional ? 1.f / (l.range * l.range) : 0.f;
+
+    // Non spot lights get a cone that every direction falls inside of.
+    vec3 spot = l.type == LIGHT_SPOT ? glm::normalize(l.direction) : vec3(0);
+    float cosInner = l.type == LIGHT_SPOT ? std::cos(l.innerCone) : 0.f;
+    float cosOuter = l.type == LIGHT_SPOT ? std::cos(l.outerCone) : -1.f;
+    set->spotX[i] = spot.x;
+    set->spotY[i] = spot.y;
+    set->spotZ[i] = spot.z;
+    set->cosOuter[i] = cosOuter;
+    set->invConeWidth[i] = 1.f / std::max(cosInner - cosOuter, 1e-4f);
+
+    bool shadowed = l.castsShadow && shadowedCount < kMaxShadowMaps &&
+                    (l.type == LIGHT_DIRECTIONAL || l.type == LIGHT_SPOT);
+    if (shadowed)
+      shadowedCount++;
+    set->unshadowed[i] = shadowed ? 0.f : 1.f;
+  }
+}
+
+// Sum of the lights reaching a surface point with the given unit normal, each
+// light scaled by its weight.
+vec3 EvaluateLights(lightSet const* lights,
+                    vec3 position,
+                    vec3 normal,
+                    float const* weights) {
+  float red = 0.f;
+  float green = 0.f;
+  float blue = 0.f;
+  for (int32_t i = 0; i < lights->count; i++) {
+    float lx = lights->x[i] - lights->positional[i] * position.x;
+    float ly = lights->y[i] - lights->positional[i] * position.y;
+    float lz = lights->z[i] - lights->positional[i] * position.z;
+    float distSq = lx * lx + ly * ly + lz * lz;
+    float invDist = 1.f / std::sqrt(distSq);
+    lx *= invDist;
+    ly *= invDist;
+    lz *= invDist;
+
+    float lambert =
+        std::max(0.f, normal.x * lx + normal.y * ly + normal.z * lz);
+    float diffuse = lights->ambient[i] + (1.f - lights->ambient[i]) * lambert;
+    float falloff = std::max(0.f, 1.f - distSq * lights->invRangeSq[i]);
+    float cosAngle = -(lx * lights->spotX[i] + ly * lights->spotY[i] +
+                       lz * lights->spotZ[i]);
+    float spot = std::min(
+        1.f, std::max(0.f, (cosAngle - lights->cosOuter[i]) *
+                               lights->invConeWidth[i]));
+
+    float intensity = weights[i] * diffuse * falloff * falloff * spot;
+    red += intensity * lights->colorR[i];
+    green += intensity * lights->colorG[i];
+    blue += intensity * lights->colorB[i];
+  }
+  return vec3(red, green, blue);
+}
+
+// Fraction of the shadow map texels around the point that see the light.
+float ShadowVisibility(shadowMap const* map, vec3 position, int32_t pcf) {
+  const float kShadowBias = 0.01f;
+  vec4 p = map->transform * vec4(position, 1.f);
+  p /= p.w;
+  float depth = p.z - kShadowBias;
+  int32_t x = p.x;
+  int32_t y = p.y;
+  if (x < 0 || y < 0 || x >= map->size || y >= map->size)
+    return 1.f;
+
+  int32_t lit = 0;
+  for (int32_t dy = -pcf; dy <= pcf; dy++) {
+    int32_t sy = std::min(map->size - 1, std::max(0, y + dy));
+    for (int32_t dx = -pcf; dx <= pcf; dx++) {
+      int32_t sx = std::min(map->size - 1, std::max(0, x + dx));
+      lit += depth <= map->depth[sx + sy * map->size];
+    }
+  }
+  return lit / (float)((2 * pcf + 1) * (2 * pcf + 1));
+}
+
+// Blinn-Phong highlights of the lights for a viewer looking down -z.
+vec3 EvaluateSpecular(lightSet const* lights,
+                      vec3 position,
+                      vec3 normal,
+                      float const* weights,
+                      float shininess) {
+  vec3 specular(0);
+  for (int32_t i = 0; i < lights->count; i++) {
+    vec3 toLight =
+        vec3(lights->x[i], lights->y[i], lights->z[i]) -
+        lights->positional[i] * position;
+    float distSq = glm::dot(toLight, toLight);
+    vec3 halfway = glm::normalize(toLight / std::sqrt(distSq) + vec3(0, 0, 1));
+    float falloff = std::max(0.f, 1.f - distSq * lights->invRangeSq[i]);
+    float highlight =
+        std::pow(std::max(0.f, glm::dot(normal, halfway)), shininess);
+    float intensity = weights[i] * (1.f - lights->ambient[i]) * falloff *
+                      falloff * highlight;
+    specular += intensity *
+                vec3(lights->colorR[i], lights->colorG[i], lights->colorB[i]);
+  }
+  return specular;
+}
+
+uint16_t PackColor565(vec3 c) {
+  int32_t r = std::min(31, std::max(0, (int32_t)(c.x * 31 / 255 + .5f)));
+  int32_t g = std::min(63, std::max(0, (int32_t)(c.y * 63 / 255 + .5f)));
+  int32_t b = std::min(31, std::max(0, (int32_t)(c.z * 31 / 255 + .5f)));
+  return r << 11 | g << 5 | b;
+}
+
+vec3 UnpackColor565(uint16_t c) {
+  int32_t r = c >> 11;
+  int32_t g = c >> 5 & 63;
+  int32_t b = c & 31;
+  return vec3(r << 3 | r >> 2, g << 2 | g >> 4, b << 3 | b >> 2);
+}
+
+// The four colors of a BC1 block with endpoints c0 > c1.
+void ColorPalette(uint16_t c0, uint16_t c1, vec3* palette) {
+  palette[0] = UnpackColor565(c0);
+  palette[1] = UnpackColor565(c1);
+  palette[2] = (2.f * palette[0] + palette[1]) / 3.f;
+  palette[3] = (palette[0] + 2.f * palette[1]) / 3.f;
+}
+
+// BC1 in four color mode. The endpoints are the extremes of the colors along
+// their principal axis.
+uint64_t EncodeColorBlock(texel const* texels) {
+  int32_t count = kTexelTile * kTexelTile;
+  vec3 colors[kTexelTile * kTexelTile];
+  vec3 mean(0);
+  for (int32_t i = 0; i < count; i++) {
+    colors[i] = vec3(texels[i].red, texels[i].green, texels[i].blue);
+    mean += colors[i] / (float)count;
+  }
+  float covariance[6] = {};
+  for (int32_t i = 0; i < count; i++) {
+    vec3 d = colors[i] - mean;
+    covariance[0] += d.x * d.x;
+    covariance[1] += d.x * d.y;
+    covariance[2] += d.x * d.z;
+    covariance[3] += d.y * d.y;
+    covariance[4] += d.y * d.z;
+    covariance[5] += d.z * d.z;
+  }
+  vec3 axis(1, 1, 1);
+  for (int32_t i = 0; i < 4; i++) {
+    axis = vec3(covariance[0] * axis.x + covariance[1] * axis.y +
+                    covariance[2] * axis.z,
+                covariance[1] * axis.x + covariance[3] * axis.y +
+                    covariance[4] * axis.z,
+                covariance[2] * axis.x + covariance[4] * axis.y +
+                    covariance[5] * axis.z);
+    float length = std::max({std::abs(axis.x), std::abs(axis.y),
+                             std::abs(axis.z)});
+    if (length == 0) {
+      axis = vec3(1, 1, 1);
+      break;
+    }
+    axis /= length;
+  }
+  float low = FLT_MAX;
+  float high = -FLT_MAX;
+  for (int32_t i = 0; i < count; i++) {
+    float t = glm::dot(colors[i] - mean, axis);
+    low = std::min(low, t);
+    high = std::max(high, t);
+  }
+  float axisSq = std::max(glm::dot(axis, axis), 1e-12f);
+  uint16_t c0 = PackColor565(mean + axis * (high / axisSq));
+  uint16_t c1 = PackColor565(mean + axis * (low / axisSq));
+  if (c0 < c1)
+    std::swap(c0, c1);
+  if (c0 == c1)
+    return c0 | (uint64_t)c1 << 16;
+
+  vec3 palette[4];
+  ColorPalette(c0, c1, palette);
+  uint64_t block = c0 | (uint64_t)c1 << 16;
+  for (int32_t i = 0; i < count; i++) {
+    uint64_t best = 0;
+    float bestDistance = FLT_MAX;
+    for (int32_t j = 0; j < 4; j++) {
+      vec3 d = colors[i] - palette[j];
+      float distance = glm::dot(d, d);
+      if (distance < bestDistance) {
+        bestDistance = distance;
+        best = j;
       }
     }
+    block |= best << (32 + 2 * i);
+  }
+  return block;
+}
 
-    void* texturePixels;
-    int pitch;
-    SDL_LockTexture(texture, 0, &texturePixels, &pitch);
-    memset(screen->framebuffer, 0x00,
-           screen->height * screen->width * sizeof(uint32_t));
+// The eight values of a BC4 block with endpoints a0 > a1.
+void ValuePalette(int32_t a0, int32_t a1, uint8_t* palette) {
+  palette[0] = a0;
+  palette[1] = a1;
+  for (int32_t i = 1; i < 7; i++)
+    palette[i + 1] = ((7 - i) * a0 + i * a1 + 3) / 7;
+}
 
-    memset(screen->depthbuffer, 0x00,
-           screen->height * screen->width * sizeof(uint8_t));
+// BC4 in eight value mode over one byte of every texel of a tile.
+uint64_t EncodeValueBlock(texel const* texels, size_t offset) {
+  int32_t count = kTexelTile * kTexelTile;
+  uint8_t values[kTexelTile * kTexelTile];
+  int32_t low = 255;
+  int32_t high = 0;
+  for (int32_t i = 0; i < count; i++) {
+    values[i] = ((uint8_t const*)&texels[i])[offset];
+    low = std::min(low, (int32_t)values[i]);
+    high = std::max(high, (int32_t)values[i]);
+  }
+  uint64_t block = high | low << 8;
+  if (low == high)
+    return block;
+  for (int32_t i = 0; i < count; i++) {
+    // Steps up from low, 7 is high itself.
+    int32_t step = ((values[i] - low) * 7 + (high - low) / 2) / (high - low);
+    uint64_t index = step == 7 ? 0 : step == 0 ? 1 : 8 - step;
+    block |= index << (16 + 3 * i);
+  }
+  return block;
+}
 
-    Draw(screen, resources);
+void DecodeValueBlock(uint64_t block, texel* texels, size_t offset) {
+  uint8_t palette[8];
+  ValuePalette(block & 0xFF, block >> 8 & 0xFF, palette);
+  for (int32_t i = 0; i < kTexelTile * kTexelTile; i++)
+    ((uint8_t*)&texels[i])[offset] = palette[block >> (16 + 3 * i) & 7];
+}
 
-    memcpy(texturePixels, screen->framebuffer,
-           screen->height * screen->width * sizeof(uint32_t));
-    SDL_UnlockTexture(texture);
-    SDL_RenderCopyEx(renderer, texture, 0, 0, 0, 0, SDL_FLIP_VERTICAL);
-    SDL_RenderPresent(renderer);
+// Compresses a tile of texels, every channel on its own.
+void EncodeBlock(texel const* texels, textureBlock* block) {
+  block->color = EncodeColorBlock(texels);
+  block->alpha = EncodeValueBlock(texels, offsetof(texel, alpha));
+  block->normalX = EncodeValueBlock(texels, offsetof(texel, normalX));
+  block->normalY = EncodeValueBlock(texels, offsetof(texel, normalY));
+  block->normalZ = EncodeValueBlock(texels, offsetof(texel, normalZ));
+  block->specular = EncodeValueBlock(texels, offsetof(texel, specular));
+}
+
+void DecodeBlock(textureBlock const* block, texel* texels) {
+  vec3 palette[4];
+  uint16_t c0 = block->color & 0xFFFF;
+  uint16_t c1 = block->color >> 16 & 0xFFFF;
+  ColorPalette(c0, c1, palette);
+  for (int32_t i = 0; i < kTexelTile * kTexelTile; i++) {
+    vec3 c = palette[block->color >> (32 + 2 * i) & 3];
+    texels[i].red = c.x + .5f;
+    texels[i].green = c.y + .5f;
+    texels[i].blue = c.z + .5f;
   }
+  DecodeValueBlock(block->alpha, texels, offsetof(texel, alpha));
+  DecodeValueBlock(block->normalX, texels, offsetof(texel, normalX));
+  DecodeValueBlock(block->normalY, texels, offsetof(texel, normalY));
+  DecodeValueBlock(block->normalZ, texels, offsetof(texel, normalZ));
+  DecodeValueBlock(block->specular, texels, offsetof(texel, specular));
 }
 
-int main() {
-  // Load model
-  resources resources = {};
-  resources.scene = aiImportFile("african_head/african_head.obj",
-                                 aiProcessPreset_TargetRealtime_Fast);
-  if (!resources.scene) {
-    std::cout << aiGetErrorString();
-    exit(0);
-  }
-
-  // Load texture
-  image image = {};
-  image.channels = 3;
-  resources.image = &image;
-  int imageChannels;
-  image.buffer = stbi_load("african_head/african_head_diffuse.tga", &image.x,
-                           &image.y, &imageChannels,
-                           /*desired_channels=*/image.channels);
-  if (!image.buffer) {
-    std::cout << stbi_failure_reason();
-    exit(0);
+// Tiles SampleMaterial() keeps decoded on every thread, direct mapped by a
+// hash of the tile so that vertical neighbours do not evict each other.
+const int32_t kBlockCacheTiles = 64;
+
+struct blockCache {
+  material const* owner[kBlockCacheTiles];
+  int32_t tile[kBlockCacheTiles];
+  texel texels[kBlockCacheTiles][kTexelTile * kTexelTile];
+};
+
+// Texels of a tile of a compressed material, valid until the thread samples
+// another compressed tile.
+texel const* DecodedTile(material const* material, int32_t tile) {
+  static thread_local blockCache cache = {};
+  int32_t slot = (uint32_t)tile * 2654435761u >> 26;
+  if (cache.owner[slot] != material || cache.tile[slot] != tile) {
+    DecodeBlock(&material->blocks[tile], cache.texels[slot]);
+    cache.owner[slot] = material;
+    cache.tile[slot] = tile;
   }
+  return cache.texels[slot];
+}
 
-  screen screen = {};
-  screen.width = 1024;
-  screen.height = 768;
-  screen.depth = 255;
+// Index of a texel among tiled texels width texels wide.
+int32_t TexelIndex(int32_t x, int32_t y, int32_t width) {
+  int32_t tilesX = (width + kTexelTile - 1) / kTexelTile;
+  int32_t tile = x / kTexelTile + y / kTexelTile * tilesX;
+  return tile * kTexelTile * kTexelTile + y % kTexelTile * kTexelTile +
+         x % kTexelTile;
+}
+
+// Samples the finest resident level from the one asked for up, and records
+// every page it looks at so that UpdatePages() streams in the missing ones.
+texel const* SamplePages(pageTable const* table, vec2 uv, int32_t level) {
+  pageCache const* cache = table->cache;
+  uint32_t frame = cache->frame;
+  for (level = std::min(level, table->levels - 1);; level++) {
+    int32_t x = std::min(table->x[level] - 1,
+                         std::max(0, (int32_t)(uv.x * table->x[level])));
+    int32_t y =
+        std::min(table->y[level] - 1,
+                 std::max(0, (int32_t)((1.f - uv.y) * table->y[level])));
+    int32_t page = table->first[level] + x / kPageTexels +
+                   y / kPageTexels * table->pagesX[level];
+    if (table->touched[page] != frame)
+      table->touched[page] = frame;
+    texel const* texels = table->tail;
+    if (level < table->levels - 1) {
+      int32_t slot = table->slots[page];
+      if (slot < 0)
+        continue;
+      texels = &cache->texels[(size_t)slot * kPageTexels * kPageTexels];
+    }
+    return &texels[TexelIndex(x % kPageTexels, y % kPageTexels, kPageTexels)];
+  }
+}
+
+// Level 0 unless the material is streamed.
+texel const* SampleMaterial(material const* material,
+                            vec2 uv,
+                            int32_t level) {
+  if (material->pages)
+    return SamplePages(material->pages, uv, level);
+  int32_t x =
+      std::min(material->x - 1, std::max(0, (int32_t)(uv.x * material->x)));
+  int32_t y = std::min(material->y - 1,
+                       std::max(0, (int32_t)((1.f - uv.y) * material->y)));
+  int32_t index = TexelIndex(x, y, material->x);
+  int32_t tileTexels = kTexelTile * kTexelTile;
+  if (material->blocks)
+    return &DecodedTile(material, index / tileTexels)[index % tileTexels];
+  return &material->texels[index];
+}
 
-  SDL_Window* window;
-  SDL_Renderer* renderer;
-  SDL_Texture* texture;
-  Initialize(&window, &renderer, &texture, &screen);
+// Level of a streamed material that samples about one texel per pixel over a
+// triangle.
+int32_t TextureLevel(material const* material,
+                     vertex const* v1,
+                     vertex const* v2,
+                     vertex const* v3) {
+  if (!material->pages)
+    return 0;
+  vec2 du = v2->uv - v1->uv;
+  vec2 dv = v3->uv - v1->uv;
+  float texels =
+      std::abs(du.x * dv.y - du.y * dv.x) * material->x * material->y;
+  vec3 dx = v2->screen - v1->screen;
+  vec3 dy = v3->screen - v1->screen;
+  float pixels = std::abs(dx.x * dy.y - dx.y * dy.x);
+  if (texels <= pixels)
+    return 0;
+  return std::log2(texels / pixels) / 2;
+}
 
-  screen.framebuffer =
-      (color*)malloc(screen.height * screen.width * sizeof(color));
+vec3 DecodeNormal(texel const* texel) {
+  return vec3(texel->normalX, texel->normalY, texel->normalZ) / 127.5f -
+         vec3(1.f);
+}
 
-  screen.depthbuffer =
-      (uint8_t*)malloc(screen.height * screen.width * sizeof(uint8_t));
+// Interpolated normal at a point of a triangle with the material's normal map
+// applied, not normalized.
+vec3 SurfaceNormal(vertex const* v1,
+                   vertex const* v2,
+                   vertex const* v3,
+                   material const* material,
+                   texel const* texel,
+                   vec3 baricenter) {
+  vec3 normal = v1->normal * baricenter.x + v2->normal * baricenter.y +
+                v3->normal * baricenter.z;
+  if (material->normals == NORMALS_OBJECT) {
+    normal = DecodeNormal(texel);
+  } else if (material->normals == NORMALS_TANGENT) {
+    vec3 tangent = v1->tangent * baricenter.x + v2->tangent * baricenter.y +
+                   v3->tangent * baricenter.z;
+    vec3 bitangent = v1->bitangent * baricenter.x +
+                     v2->bitangent * baricenter.y +
+                     v3->bitangent * baricenter.z;
+    vec3 local = DecodeNormal(texel);
+    normal = tangent * local.x + bitangent * local.y + normal * local.z;
+  }
+  return normal;
+}
+
+// Folds the unit sphere onto the octahedron |x| + |y| + |z| = 1 and that onto
+// a square, which spreads precision evenly over all directions.
+uint32_t PackNormal(vec3 normal) {
+  normal /= std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+  vec2 p(normal.x, normal.y);
+  if (normal.z < 0)
+    p = vec2((1 - std::abs(normal.y)) * (normal.x < 0 ? -1 : 1),
+             (1 - std::abs(normal.x)) * (normal.y < 0 ? -1 : 1));
+  uint32_t x = (p.x * .5f + .5f) * 65535 + .5f;
+  uint32_t y = (p.y * .5f + .5f) * 65535 + .5f;
+  return x | y << 16;
+}
+
+vec3 UnpackNormal(uint32_t packed) {
+  vec2 p = vec2(packed & 0xFFFF, packed >> 16) / 32767.5f - vec2(1);
+  vec3 normal(p.x, p.y, 1 - std::abs(p.x) - std::abs(p.y));
+  if (normal.z < 0)
+    normal = vec3((1 - std::abs(p.y)) * (p.x < 0 ? -1 : 1),
+                  (1 - std::abs(p.x)) * (p.y < 0 ? -1 : 1), normal.z);
+  return glm::normalize(normal);
+}
+
+uint8_t Shade(float light, uint8_t channel, float specular) {
+  return (uint8_t)std::min(255.f, light * channel + specular);
+}
+
+// White point of the HDR tone curve, in exposed radiance.
+const float kHdrWhite = 4;
+
+float SrgbToLinear(uint8_t channel) {
+  static float const* table = [] {
+    static float linear[256];
+    for (int32_t i = 0; i < 256; i++) {
+      float value = i / 255.f;
+      linear[i] = value <= 0.04045f
+                      ? value / 12.92f
+                      : std::pow((value + 0.055f) / 1.055f, 2.4f);
+    }
+    return linear;
+  }();
+  return table[channel];
+}
+
+// Linear and unclamped, 1 is a white texel under a unit light.
+vec3 Radiance(vec3 light,
+              uint8_t red,
+              uint8_t green,
+              uint8_t blue,
+              vec3 specular) {
+  return light * vec3(SrgbToLinear(red), SrgbToLinear(green),
+                      SrgbToLinear(blue)) +
+         specular / 255.f;
+}
+
+// Extended Reinhard curve followed by the sRGB encode, whose power is
+// approximated with three square roots. ResolveHdr() does the same per lane.
+uint8_t EncodeChannel(float value, float exposure) {
+  float x = std::max(0.f, value * exposure);
+  float mapped = std::min(
+      1.f, x * (1 + x * (1 / (kHdrWhite * kHdrWhite))) / (1 + x));
+  float s1 = std::sqrt(mapped);
+  float s2 = std::sqrt(s1);
+  float s3 = std::sqrt(s2);
+  float encoded = mapped < 0.0031308f ? mapped * 12.92f
+                                      : 0.585122381f * s1 +
+                                            0.783140355f * s2 -
+                                            0.368262736f * s3;
+  return (int32_t)(encoded * 255 + 0.5f);
+}
 
-  EventLoop(&screen, &resources, renderer, texture);
+color EncodeRadiance(vec3 radiance, float exposure) {
+  return ColorRGB(EncodeChannel(radiance.x, exposure),
+                  EncodeChannel(radiance.y, exposure),
+                  EncodeChannel(radiance.z, exposure));
+}
+
+void StoreRadiance(screen* screen, int32_t x, int32_t y, vec3 radiance) {
+  float* pixel = (float*)TargetRow(screen->hdr, y) + 4 * x;
+  pixel[0] = radiance.x;
+  pixel[1] = radiance.y;
+  pixel[2] = radiance.z;
+  pixel[3] = 0;
+}
+
+// Depth tests every covered sample and shades the pixel once when any of them
+// passes. The color goes to a slot no other sample of the pixel still uses,
+// or a new one, and the passing samples are pointed at it.
+template <typename Shade>
+void DrawTriangleSamples(screen* screen,
+                         vec3 v1,
+                         vec3 v2,
+                         vec3 v3,
+                         Shade& shade) {
+  sampleBuffer* samples = screen->samples;
+  samplePattern const* pattern = SamplePattern(samples->count);
+
+  // Depth plane of the triangle, to move depth from the center to a sample.
+  float det = (v2.x - v1.x) * (v3.y - v1.y) - (v3.x - v1.x) * (v2.y - v1.y);
+  float dzdx =
+      ((v2.z - v1.z) * (v3.y - v1.y) - (v3.z - v1.z) * (v2.y - v1.y)) / det;
+  float dzdy =
+      ((v2.x - v1.x) * (v3.z - v1.z) - (v3.x - v1.x) * (v2.z - v1.z)) / det;
+  float sampleZ[kMaxSamples];
+  for (int32_t s = 0; s < pattern->count; s++)
+    sampleZ[s] = (pattern->x[s] * dzdx + pattern->y[s] * dzdy) / kSubpixelOne;
+
+  auto fragment = [&](int32_t x, int32_t y, vec3 baricenter,
+                      uint32_t coverage) {
+    int32_t pixel = x + y * screen->width;
+    float* depth = &samples->depth[pixel * kMaxSamples];
+    float pointz = v1.z * baricenter.x + v2.z * baricenter.y +
+                   v3.z * baricenter.z;
+    uint32_t passed = 0;
+    for (int32_t s = 0; s < pattern->count; s++) {
+      float z = pointz + sampleZ[s];
+      if ((coverage >> s & 1) && z > depth[s]) {
+        depth[s] = z;
+        passed |= 1u << s;
+      }
+    }
+    if (!passed)
+      return;
+
+    uint32_t slots = samples->slots[pixel];
+    uint32_t used = 0;
+    for (int32_t s = 0; s < pattern->count; s++) {
+      uint32_t slot = slots >> (4 * s) & 0xF;
+      if (!(passed >> s & 1) && slot != kEmptySlot)
+        used |= 1u << slot;
+    }
+    uint32_t slot = 0;
+    while (used >> slot & 1)
+      slot++;
+
+    samples->colors[pixel * kMaxSamples + slot] = shade(baricenter);
+    for (int32_t s = 0; s < pattern->count; s++) {
+      if (passed >> s & 1)
+        slots = (slots & ~(0xFu << (4 * s))) | slot << (4 * s);
+    }
+    samples->slots[pixel] = slots;
+  };
+
+  RasterizeTriangleSamples(screen->width, screen->height, v1, v2, v3, pattern,
+                           fragment);
+}
+
+void DrawTriangle(screen* screen,
+                  frame const* frame,
+                  vertex const* v1,
+                  vertex const* v2,
+                  vertex const* v3,
+                  material const* material) {
+  lightSet const* lights = frame->lights;
+  bool shadows = false;
+  for (int32_t i = 0; i < lights->count; i++)
+    shadows |= lights->unshadowed[i] == 0;
+  // Normal and specular maps need the lights evaluated at every pixel.
+  bool perPixel = frame->shading == SHADE_PIXEL ||
+                  material->normals != NORMALS_NONE || material->specular;
+  int32_t level = TextureLevel(material, v1, v2, v3);
 
-  Destroy(&screen, window, renderer, texture);
-  aiReleaseImport(resources.scene);
-  stbi_image_free((void*)image.buffer);
+  // Samples the texel at a point and the light and specular reaching it.
+  auto illuminate = [&](vec3 baricenter, vec3* lightOut, vec3* specularOut) {
+    vec2 textureCoords = v1->uv * baricenter.x + v2->uv * baricenter.y +
+                         v3->uv * baricenter.z;
+    texel const* texel = SampleMaterial(material, textureCoords, level);
+
+    vec3& light = *lightOut;
+    vec3& specular = *specularOut;
+    light = vec3(0);
+    specular = vec3(0);
+    if (!perPixel)
+      light = v1->light * baricenter.x + v2->light * baricenter.y +
+              v3->light * baricenter.z;
+
+    // Shadowed lights are left out of the cached terms, so they are
+    // evaluated here for every shading mode. Those without a map are lit
+    // as if unshadowed.
+    if (perPixel || shadows) {
+      vec3 position = v1->position * baricenter.x +
+                      v2->position * baricenter.y +
+                      v3->position * baricenter.z;
+      vec3 normal = glm::normalize(
+          SurfaceNormal(v1, v2, v3, material, texel, baricenter));
+
+      float weights[kMaxLights];
+      for (int32_t i = 0; i < lights->count; i++)
+        weights[i] = perPixel ? 1 : 1 - lights->unshadowed[i];
+      for (int32_t i = 0; i < frame->shadowMapCount; i++) {
+        shadowMap const* map = &frame->shadowMaps[i];
+        if (map->light >= 0)
+          weights[map->light] = ShadowVisibility(map, position, frame->pcf);
+      }
+      light += EvaluateLights(lights, position, normal, weights);
+      if (material->specular)
+        specular = (float)texel->specular *
+                   EvaluateSpecular(lights, position, normal, weights,
+                                    material->shininess);
+    }
+    return texel;
+  };
+
+  auto radiance = [&](vec3 baricenter) {
+    vec3 light;
+    vec3 specular;
+    texel const* texel = illuminate(baricenter, &light, &specular);
+    return Radiance(light, texel->red, texel->green, texel->blue, specular);
+  };
+
+  // Tone mapped right away under HDR, for the paths that keep 8 bit colors.
+  auto shade = [&](vec3 baricenter) {
+    if (frame->hdr)
+      return EncodeRadiance(radiance(baricenter), frame->exposure);
+    vec3 light;
+    vec3 specular;
+    texel const* texel = illuminate(baricenter, &light, &specular);
+    return ColorRGB(Shade(light.x, texel->red, specular.x),
+                    Shade(light.y, texel->green, specular.y),
+                    Shade(light.z, texel->blue, specular.z));
+  };
+
+  // Accumulated behind the opaque depth without writing it, in any order.
+  if (material->transparent) {
+    oitBuffer* oit = screen->oit;
+    oit->pending = true;
+    sampleBuffer const* samples = screen->samples;
+    bool multisample = samples->count > 1 && !frame->deferred;
+    auto blend = [&](int32_t x, int32_t y, vec3 baricenter) {
+      float pointz = v1->screen.z * baricenter.x +
+                     v2->screen.z * baricenter.y + v3->screen.z * baricenter.z;
+      int32_t pixel = x + y * screen->width;
+      float opaque = screen->depthbuffer[pixel];
+      if (multisample) {
+        float const* depth = &samples->depth[pixel * kMaxSamples];
+        opaque = *std::max_element(depth, depth + samples->count);
+      }
+      if (pointz <= opaque)
+        return;
+      vec2 uv = v1->uv * baricenter.x + v2->uv * baricenter.y +
+                v3->uv * baricenter.z;
+      float alpha = SampleMaterial(material, uv, level)->alpha / 255.f *
+                    material->opacity;
+      if (alpha <= 0)
+        return;
+
+      // Nearer layers dominate the average where several overlap.
+      float distance = 1 - pointz / screen->depth;
+      float distance4 = distance * distance * distance * distance;
+      float weight =
+          alpha * std::min(3e3f, std::max(1e-2f, 0.03f / (1e-5f + distance4)));
+      color c = shade(baricenter);
+      float* accum = &oit->accum[4 * pixel];
+      accum[0] += c.red * weight;
+      accum[1] += c.green * weight;
+      accum[2] += c.blue * weight;
+      accum[3] += weight;
+      oit->revealage[pixel] *= 1 - alpha;
+    };
+    RasterizeTriangle(screen->width, screen->height, v1->screen, v2->screen,
+                      v3->screen, frame->raster, blend);
+    return;
+  }
+
+  // Stores what ShadeDeferred() needs instead of shading, lights are only
+  // evaluated once per pixel that ends up visible.
+  if (frame->deferred) {
+    gBuffer* gbuffer = screen->gbuffer;
+    uint8_t shininess = std::min(255.f, material->shininess);
+    auto store = [&](int32_t x, int32_t y, vec3 baricenter) {
+      float pointz = v1->screen.z * baricenter.x +
+                     v2->screen.z * baricenter.y + v3->screen.z * baricenter.z;
+      int32_t pixel = x + y * screen->width;
+      if (pointz <= screen->depthbuffer[pixel])
+        return;
+      screen->depthbuffer[pixel] = pointz;
+      vec2 uv = v1->uv * baricenter.x + v2->uv * baricenter.y +
+                v3->uv * baricenter.z;
+      texel const* texel = SampleMaterial(material, uv, level);
+      gbuffer->normals[pixel] = PackNormal(
+          glm::normalize(SurfaceNormal(v1, v2, v3, material, texel,
+                                       baricenter)));
+      gbuffer->albedo[pixel] =
+          color{material->specular ? texel->specular : (uint8_t)0,
+                texel->blue, texel->green, texel->red};
+      gbuffer->shininess[pixel] = shininess;
+    };
+    RasterizeTriangle(screen->width, screen->height, v1->screen, v2->screen,
+                      v3->screen, frame->raster, store);
+    return;
+  }
+
+  if (screen->samples->count > 1) {
+    DrawTriangleSamples(screen, v1->screen, v2->screen, v3->screen, shade);
+    return;
+  }
+
+  auto fragment = [&](int32_t x, int32_t y, vec3 baricenter) {
+    float pointz = v1->screen.z * baricenter.x + v2->screen.z * baricenter.y +
+                   v3->screen.z * baricenter.z;
+    float* pixelDepth = screen->depthbuffer + (x + y * screen->width);
+    if (pointz <= *pixelDepth)
+      return;
+    *pixelDepth = pointz;
+    if (frame->hdr)
+      StoreRadiance(screen, x, y, radiance(baricenter));
+    else
+      FrameRow(screen, y)[x] = shade(baricenter);
+  };
+
+  RasterizeTriangle(screen->width, screen->height, v1->screen, v2->screen,
+                    v3->screen, frame->raster, fragment);
+}
+
+void Destroy(screen* screen,
+             SDL_Window* window,
+             SDL_Renderer* renderer,
+             SDL_Texture* texture);
+
+vec3 convertGlm(aiVector3D vec) {
+  return vec3(vec.x, vec.y, vec.z);
+}
+
+mat4 convertGlm(aiMatrix4x4 const& matrix) {
+  mat4 m;
+  for (int32_t row = 0; row < 4; row++) {
+    for (int32_t column = 0; column < 4; column++)
+      m[column][row] = matrix[row][column];
+  }
+  return m;
+}
+
+vec3 FaceNormal(mesh const* mesh, size_t face) {
+  vec3 v1 = mesh->positions[mesh->indices[3 * face]];
+  vec3 v2 = mesh->positions[mesh->indices[3 * face + 1]];
+  vec3 v3 = mesh->positions[mesh->indices[3 * face + 2]];
+  return glm::normalize(glm::cross(v2 - v1, v3 - v1));
+}
+
+// Recomputes the per face or per vertex light terms when the lights or the
+// shading mode changed since the last frame, static lights cost nothing.
+void UpdateLightCache(mesh* mesh, frame const* frame) {
+  lightCache* cache = &mesh->lightCache;
+  if (frame->shading == SHADE_PIXEL)
+    return;
+  if (cache->version == frame->lights->version &&
+      cache->shading == frame->shading)
+    return;
+  cache->version = frame->lights->version;
+  cache->shading = frame->shading;
+
+  if (frame->shading == SHADE_FACE) {
+    size_t faces = mesh->indices.size() / 3;
+    cache->terms.resize(faces);
+    for (size_t i = 0; i < faces; i++) {
+      vec3 center = (mesh->positions[mesh->indices[3 * i]] +
+                     mesh->positions[mesh->indices[3 * i + 1]] +
+                     mesh->positions[mesh->indices[3 * i + 2]]) /
+                    3.f;
+      cache->terms[i] = EvaluateLights(frame->lights, center,
+                                       FaceNormal(mesh, i),
+                                       frame->lights->unshadowed);
+    }
+  } else {
+    cache->terms.resize(mesh->positions.size());
+    for (size_t i = 0; i < mesh->positions.size(); i++) {
+      cache->terms[i] =
+          EvaluateLights(frame->lights, mesh->positions[i], mesh->normals[i],
+                         frame->lights->unshadowed);
+    }
+  }
+}
+
+// Model space to the light's clip space for a shadow casting light.
+mat4 LightProjection(lightSet const* lights, int32_t i, float radius) {
+  vec3 toLight(lights->x[i], lights->y[i], lights->z[i]);
+  vec3 forward = lights->positional[i] > 0.f
+                     ? vec3(lights->spotX[i], lights->spotY[i],
+                            lights->spotZ[i])
+                     : -toLight;
+  vec3 up = std::abs(forward.y) < 0.99f ? vec3(0, 1, 0) : vec3(1, 0, 0);
+
+  if (lights->positional[i] > 0.f) {
+    float range = 1.f / std::sqrt(lights->invRangeSq[i]);
+    float outerCone = std::acos(lights->cosOuter[i]);
+    return glm::perspective(2.f * outerCone, 1.f, 0.05f, range) *
+           glm::lookAt(toLight, toLight + forward, up);
+  }
+  vec3 eye = toLight * 2.f * radius;
+  return glm::ortho(-radius, radius, -radius, radius, radius, 3.f * radius) *
+         glm::lookAt(eye, vec3(0), up);
+}
+
+// Depth-only render of the scene from every shadow casting light. Maps are
+// only re-rendered when the lights change.
+void ShadowPass(resources const* resources, frame const* frame) {
+  lightSet const* lights = frame->lights;
+  int32_t next = 0;
+  for (int32_t i = 0; i < lights->count && next < frame->shadowMapCount; i++) {
+    if (lights->unshadowed[i] > 0.f)
+      continue;
+    shadowMap* map = &frame->shadowMaps[next++];
+    if (map->light == i && map->version == lights->version)
+      continue;
+    map->light = i;
+    map->version = lights->version;
+
+    float half = map->size / 2.f;
+    mat4 viewport = glm::scale(glm::translate(mat4(1.f), vec3(half, half, 0)),
+                               vec3(half, half, 1));
+    map->transform = viewport * LightProjection(lights, i, resources->radius);
+
+    for (int32_t j = 0; j < map->size * map->size; j++)
+      map->depth[j] = 1.f;
+    // Always from the full meshes, the maps are reused across frames that
+    // may draw other levels of detail.
+    for (mesh const& mesh : resources->meshes) {
+      for (size_t j = 0; j < 3 * mesh.lods[0].faceCount; j += 3) {
+        vec3 v[3];
+        for (int32_t k = 0; k < 3; k++) {
+          vec4 p = map->transform *
+                   vec4(mesh.positions[mesh.indices[j + k]], 1.f);
+          v[k] = vec3(p) / p.w;
+        }
+        RasterizeTriangle(map->size, map->size, v[0], v[1], v[2],
+                          frame->raster,
+                          [&](int32_t x, int32_t y, vec3 baricenter) {
+                            float depth = v[0].z * baricenter.x +
+                                          v[1].z * baricenter.y +
+                                          v[2].z * baricenter.z;
+                            float* texel = &map->depth[x + y * map->size];
+                            *texel = std::min(*texel, depth);
+                          });
+      }
+    }
+  }
+  for (; next < frame->shadowMapCount; next++)
+    frame->shadowMaps[next].light = -1;
+}
+
+// Deep enough for any hierarchy BuildBvh() makes.
+const int32_t kMaxBvhDepth = 64;
+
+// Bins per axis the surface area heuristic evaluates splits at.
+const int32_t kBvhBins = 16;
+
+// Cost of visiting a node, relative to testing one item.
+const float kBvhTraversalCost = 1.f;
+
+float SurfaceArea(vec3 low, vec3 high) {
+  vec3 size = glm::max(high - low, vec3(0));
+  return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+void BuildBvhNode(std::vector<vec3> const& lows,
+                  std::vector<vec3> const& highs,
+                  uint32_t begin,
+                  uint32_t end,
+                  uint32_t maxLeaf,
+                  int32_t depth,
+                  bvh* bvh) {
+  uint32_t index = bvh->nodes.size();
+  bvh->nodes.emplace_back();
+  uint32_t* items = bvh->items.data();
+
+  vec3 low(FLT_MAX);
+  vec3 high(-FLT_MAX);
+  vec3 centerLow(FLT_MAX);
+  vec3 centerHigh(-FLT_MAX);
+  for (uint32_t i = begin; i < end; i++) {
+    low = glm::min(low, lows[items[i]]);
+    high = glm::max(high, highs[items[i]]);
+    vec3 center = (lows[items[i]] + highs[items[i]]) / 2.f;
+    centerLow = glm::min(centerLow, center);
+    centerHigh = glm::max(centerHigh, center);
+  }
+  bvh->nodes[index].low = low;
+  bvh->nodes[index].high = high;
+
+  // Cheapest split into binned centroid ranges, costed as the area of each
+  // side times its items.
+  uint32_t count = end - begin;
+  float bestCost = FLT_MAX;
+  int32_t bestAxis = -1;
+  int32_t bestBin = 0;
+  for (int32_t axis = 0; axis < 3 && count > 1; axis++) {
+    float extent = centerHigh[axis] - centerLow[axis];
+    if (extent <= 0)
+      continue;
+    struct {
+      vec3 low = vec3(FLT_MAX);
+      vec3 high = vec3(-FLT_MAX);
+      uint32_t count = 0;
+    } bins[kBvhBins];
+    for (uint32_t i = begin; i < end; i++) {
+      float center = (lows[items[i]][axis] + highs[items[i]][axis]) / 2;
+      int32_t b = std::min<int32_t>(
+          (center - centerLow[axis]) / extent * kBvhBins, kBvhBins - 1);
+      bins[b].low = glm::min(bins[b].low, lows[items[i]]);
+      bins[b].high = glm::max(bins[b].high, highs[items[i]]);
+      bins[b].count++;
+    }
+    // Areas and counts of everything left of each bin boundary.
+    float leftArea[kBvhBins];
+    uint32_t leftCount[kBvhBins];
+    vec3 sideLow(FLT_MAX);
+    vec3 sideHigh(-FLT_MAX);
+    uint32_t sideCount = 0;
+    for (int32_t b = 0; b < kBvhBins - 1; b++) {
+      sideLow = glm::min(sideLow, bins[b].low);
+      sideHigh = glm::max(sideHigh, bins[b].high);
+      sideCount += bins[b].count;
+      leftArea[b] = SurfaceArea(sideLow, sideHigh);
+      leftCount[b] = sideCount;
+    }
+    sideLow = vec3(FLT_MAX);
+    sideHigh = vec3(-FLT_MAX);
+    sideCount = 0;
+    for (int32_t b = kBvhBins - 1; b > 0; b--) {
+      sideLow = glm::min(sideLow, bins[b].low);
+      sideHigh = glm::max(sideHigh, bins[b].high);
+      sideCount += bins[b].count;
+      if (leftCount[b - 1] == 0 || sideCount == 0)
+        continue;
+      float cost = leftArea[b - 1] * leftCount[b - 1] +
+                   SurfaceArea(sideLow, sideHigh) * sideCount;
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestBin = b;
+      }
+    }
+  }
+
+  // A leaf when visiting two children and testing their items, weighted by
+  // the chance a ray through the node hits each, costs more than testing
+  // every item, unless that makes it too large.
+  float area = SurfaceArea(low, high);
+  float splitCost =
+      area > 0 ? kBvhTraversalCost + bestCost / area : (float)count;
+  bool leaf = bestAxis < 0 || depth >= kMaxBvhDepth - 1 ||
+              (splitCost >= count && count <= maxLeaf);
+  if (leaf) {
+    bvh->nodes[index].offset = begin;
+    bvh->nodes[index].count = count;
+    return;
+  }
+
+  float extent = centerHigh[bestAxis] - centerLow[bestAxis];
+  uint32_t* middle =
+      std::partition(items + begin, items + end, [&](uint32_t i) {
+        float center = (lows[i][bestAxis] + highs[i][bestAxis]) / 2;
+        int32_t b = std::min<int32_t>(
+            (center - centerLow[bestAxis]) / extent * kBvhBins, kBvhBins - 1);
+        return b < bestBin;
+      });
+  uint32_t split = middle - items;
+  BuildBvhNode(lows, highs, begin, split, maxLeaf, depth + 1, bvh);
+  bvh->nodes[index].offset = bvh->nodes.size();
+  bvh->nodes[index].count = 0;
+  BuildBvhNode(lows, highs, split, end, maxLeaf, depth + 1, bvh);
+}
+
+// Builds a hierarchy over boxes with the surface area heuristic, leaves hold
+// at most maxLeaf items unless the boxes cannot be told apart.
+void BuildBvh(std::vector<vec3> const& lows,
+              std::vector<vec3> const& highs,
+              uint32_t maxLeaf,
+              bvh* bvh) {
+  bvh->nodes.clear();
+  bvh->items.resize(lows.size());
+  for (uint32_t i = 0; i < lows.size(); i++)
+    bvh->items[i] = i;
+  if (!lows.empty())
+    BuildBvhNode(lows, highs, 0, lows.size(), maxLeaf, 0, bvh);
+}
+
+// Calls visit(item) for the items of every leaf that overlaps the view
+// volume, [-1, 1] on every axis.
+template <typename Visit>
+void CullBvh(bvh const* bvh, Visit visit) {
+  if (bvh->nodes.empty())
+    return;
+  uint32_t stack[kMaxBvhDepth];
+  int32_t top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    bvhNode const* node = &bvh->nodes[index];
+    if (node->low.x > 1 || node->low.y > 1 || node->low.z > 1 ||
+        node->high.x < -1 || node->high.y < -1 || node->high.z < -1)
+      continue;
+    if (node->count) {
+      for (uint32_t i = 0; i < node->count; i++)
+        visit(bvh->items[node->offset + i]);
+    } else {
+      stack[top++] = node->offset;
+      stack[top++] = index + 1;
+    }
+  }
+}
+
+// Distance along the ray where it enters the node, or FLT_MAX when it misses
+// it before farthest.
+float IntersectNode(bvhNode const* node,
+                    vec3 origin,
+                    vec3 inverse,
+                    float farthest) {
+  vec3 t0 = (node->low - origin) * inverse;
+  vec3 t1 = (node->high - origin) * inverse;
+  vec3 near = glm::min(t0, t1);
+  vec3 far = glm::max(t0, t1);
+  float enter = std::max({near.x, near.y, near.z, 0.f});
+  float exit = std::min({far.x, far.y, far.z, farthest});
+  return enter <= exit ? enter : FLT_MAX;
+}
+
+// Calls intersect(item, &farthest) for the items of every leaf the ray
+// reaches before farthest, nearest nodes first, intersect shortens farthest
+// when it finds a hit.
+template <typename Intersect>
+void TraverseBvh(bvh const* bvh,
+                 vec3 origin,
+                 vec3 direction,
+                 float* farthest,
+                 Intersect intersect) {
+  if (bvh->nodes.empty())
+    return;
+  // Keeps the slab distances finite for rays parallel to an axis, as
+  // SetPacketRay() does.
+  vec3 inverse;
+  for (int32_t axis = 0; axis < 3; axis++)
+    inverse[axis] = 1 / (direction[axis] != 0 ? direction[axis] : 1e-20f);
+  uint32_t stack[kMaxBvhDepth];
+  int32_t top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    bvhNode const* node = &bvh->nodes[index];
+    if (IntersectNode(node, origin, inverse, *farthest) == FLT_MAX)
+      continue;
+    if (node->count) {
+      for (uint32_t i = 0; i < node->count; i++)
+        intersect(bvh->items[node->offset + i], farthest);
+      continue;
+    }
+    uint32_t first = index + 1;
+    uint32_t second = node->offset;
+    if (IntersectNode(&bvh->nodes[first], origin, inverse, *farthest) >
+        IntersectNode(&bvh->nodes[second], origin, inverse, *farthest))
+      std::swap(first, second);
+    stack[top++] = second;
+    stack[top++] = first;
+  }
+}
+
+// Möller-Trumbore, returns the distance along the ray or FLT_MAX on a miss.
+// Both sides of the triangle are hit.
+float IntersectTriangle(vec3 origin,
+                        vec3 direction,
+                        vec3 v1,
+                        vec3 v2,
+                        vec3 v3,
+                        vec3* baricenter) {
+  vec3 edge1 = v2 - v1;
+  vec3 edge2 = v3 - v1;
+  vec3 p = glm::cross(direction, edge2);
+  float det = glm::dot(edge1, p);
+  if (det == 0)
+    return FLT_MAX;
+  float inverse = 1 / det;
+  vec3 offset = origin - v1;
+  float u = glm::dot(offset, p) * inverse;
+  if (u < 0 || u > 1)
+    return FLT_MAX;
+  vec3 q = glm::cross(offset, edge1);
+  float v = glm::dot(direction, q) * inverse;
+  if (v < 0 || u + v > 1)
+    return FLT_MAX;
+  float t = glm::dot(edge2, q) * inverse;
+  if (t < 0)
+    return FLT_MAX;
+  *baricenter = vec3(1 - u - v, u, v);
+  return t;
+}
+
+struct rayHit {
+  float distance;
+  uint32_t mesh;
+  uint32_t face;
+  vec3 baricenter;
+};
+
+// Finds the nearest face of the full level of any mesh along the ray, up to
+// farthest.
+bool Raycast(resources const* resources,
+             vec3 origin,
+             vec3 direction,
+             float farthest,
+             rayHit* hit) {
+  hit->distance = farthest;
+  bool found = false;
+  TraverseBvh(&resources->meshBvh, origin, direction, &farthest,
+              [&](uint32_t m, float* farthest) {
+                mesh const* mesh = &resources->meshes[m];
+                TraverseBvh(
+                    &mesh->faceBvh, origin, direction, farthest,
+                    [&](uint32_t face, float* farthest) {
+                      uint32_t const* index = &mesh->indices[3 * face];
+                      vec3 baricenter;
+                      float t = IntersectTriangle(
+                          origin, direction, mesh->positions[index[0]],
+                          mesh->positions[index[1]],
+                          mesh->positions[index[2]], &baricenter);
+                      if (t < *farthest) {
+                        *farthest = t;
+                        *hit = {t, m, face, baricenter};
+                        found = true;
+                      }
+                    });
+              });
+  return found;
+}
+
+// Rays traced together, one per SIMD lane.
+const int32_t kPacketRays = 4;
+
+// Lanes whose farthest is negative are finished and never hit anything.
+struct rayPacket {
+  float origin[3][kPacketRays];
+  float direction[3][kPacketRays];
+  float inverse[3][kPacketRays];
+  float farthest[kPacketRays];
+};
+
+void SetPacketRay(rayPacket* packet,
+                  int32_t lane,
+                  vec3 origin,
+                  vec3 direction,
+                  float farthest) {
+  for (int32_t axis = 0; axis < 3; axis++) {
+    // Keeps the slab distances finite for rays parallel to an axis.
+    float d = direction[axis] != 0 ? direction[axis] : 1e-20f;
+    packet->origin[axis][lane] = origin[axis];
+    packet->direction[axis][lane] = direction[axis];
+    packet->inverse[axis][lane] = 1 / d;
+  }
+  packet->farthest[lane] = farthest;
+}
+
+// Lanes that reach the node, nearest is where the first of them enters it.
+uint32_t IntersectNodePacket(bvhNode const* node,
+                             rayPacket const* packet,
+                             float* nearest) {
+  float enter[kPacketRays];
+  uint32_t lanes = 0;
+#if defined(__SSE2__)
+  __m128 near = _mm_setzero_ps();
+  __m128 far = _mm_loadu_ps(packet->farthest);
+  for (int32_t axis = 0; axis < 3; axis++) {
+    __m128 origin = _mm_loadu_ps(packet->origin[axis]);
+    __m128 inverse = _mm_loadu_ps(packet->inverse[axis]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->low[axis]), origin),
+                           inverse);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node->high[axis]), origin),
+                           inverse);
+    near = _mm_max_ps(near, _mm_min_ps(t0, t1));
+    far = _mm_min_ps(far, _mm_max_ps(t0, t1));
+  }
+  lanes = _mm_movemask_ps(_mm_cmple_ps(near, far));
+  _mm_storeu_ps(enter, near);
+#else
+  for (int32_t lane = 0; lane < kPacketRays; lane++) {
+    float near = 0;
+    float far = packet->farthest[lane];
+    for (int32_t axis = 0; axis < 3; axis++) {
+      float origin = packet->origin[axis][lane];
+      float inverse = packet->inverse[axis][lane];
+      float t0 = (node->low[axis] - origin) * inverse;
+      float t1 = (node->high[axis] - origin) * inverse;
+      near = std::max(near, std::min(t0, t1));
+      far = std::min(far, std::max(t0, t1));
+    }
+    enter[lane] = near;
+    lanes |= (near <= far) << lane;
+  }
+#endif
+  *nearest = FLT_MAX;
+  for (int32_t lane = 0; lane < kPacketRays; lane++) {
+    if (lanes >> lane & 1)
+      *nearest = std::min(*nearest, enter[lane]);
+  }
+  return lanes;
+}
+
+// Möller-Trumbore for every lane, returns the lanes that hit the triangle
+// before their farthest with their distances and barycentric u and v.
+uint32_t IntersectTrianglePacket(rayPacket const* packet,
+                                 vec3 v1,
+                                 vec3 v2,
+                                 vec3 v3,
+                                 float* t,
+                                 float* u,
+                                 float* v) {
+  vec3 edge1 = v2 - v1;
+  vec3 edge2 = v3 - v1;
+#if defined(__SSE2__)
+  __m128 dx = _mm_loadu_ps(packet->direction[0]);
+  __m128 dy = _mm_loadu_ps(packet->direction[1]);
+  __m128 dz = _mm_loadu_ps(packet->direction[2]);
+  __m128 e1x = _mm_set1_ps(edge1.x);
+  __m128 e1y = _mm_set1_ps(edge1.y);
+  __m128 e1z = _mm_set1_ps(edge1.z);
+  __m128 e2x = _mm_set1_ps(edge2.x);
+  __m128 e2y = _mm_set1_ps(edge2.y);
+  __m128 e2z = _mm_set1_ps(edge2.z);
+
+  // p = direction x edge2
+  __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+  __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+  __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+  __m128 det = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+      _mm_mul_ps(e1z, pz));
+  __m128 inverse = _mm_div_ps(_mm_set1_ps(1.f), det);
+
+  __m128 sx = _mm_sub_ps(_mm_loadu_ps(packet->origin[0]), _mm_set1_ps(v1.x));
+  __m128 sy = _mm_sub_ps(_mm_loadu_ps(packet->origin[1]), _mm_set1_ps(v1.y));
+  __m128 sz = _mm_sub_ps(_mm_loadu_ps(packet->origin[2]), _mm_set1_ps(v1.z));
+  __m128 uu = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                 _mm_mul_ps(sz, pz)),
+      inverse);
+
+  // q = offset x edge1
+  __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+  __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+  __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+  __m128 vv = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)),
+                 _mm_mul_ps(dz, qz)),
+      inverse);
+  __m128 tt = _mm_mul_ps(
+      _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                 _mm_mul_ps(e2z, qz)),
+      inverse);
+
+  // NaNs from a zero determinant fail every comparison.
+  __m128 zero = _mm_setzero_ps();
+  __m128 hit = _mm_and_ps(_mm_cmpneq_ps(det, zero), _mm_cmpge_ps(uu, zero));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(vv, zero));
+  hit = _mm_and_ps(hit, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.f)));
+  hit = _mm_and_ps(hit, _mm_cmpge_ps(tt, zero));
+  hit = _mm_and_ps(hit, _mm_cmplt_ps(tt, _mm_loadu_ps(packet->farthest)));
+  _mm_storeu_ps(t, tt);
+  _mm_storeu_ps(u, uu);
+  _mm_storeu_ps(v, vv);
+  return _mm_movemask_ps(hit);
+#else
+  uint32_t lanes = 0;
+  for (int32_t lane = 0; lane < kPacketRays; lane++) {
+    vec3 origin(packet->origin[0][lane], packet->origin[1][lane],
+                packet->origin[2][lane]);
+    vec3 direction(packet->direction[0][lane], packet->direction[1][lane],
+                   packet->direction[2][lane]);
+    vec3 baricenter;
+    t[lane] = IntersectTriangle(origin, direction, v1, v2, v3, &baricenter);
+    u[lane] = baricenter.y;
+    v[lane] = baricenter.z;
+    lanes |= (t[lane] < packet->farthest[lane]) << lane;
+  }
+  return lanes;
+#endif
+}
+
+// Packet version of TraverseBvh(), a node is visited when any lane reaches
+// it and intersect(item, lanes) gets the lanes that do.
+template <typename Intersect>
+void TraverseBvhPacket(bvh const* bvh,
+                       rayPacket* packet,
+                       Intersect intersect) {
+  if (bvh->nodes.empty())
+    return;
+  uint32_t stack[kMaxBvhDepth];
+  int32_t top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    bvhNode const* node = &bvh->nodes[index];
+    float nearest;
+    uint32_t lanes = IntersectNodePacket(node, packet, &nearest);
+    if (!lanes)
+      continue;
+    if (node->count) {
+      for (uint32_t i = 0; i < node->count; i++)
+        intersect(bvh->items[node->offset + i], lanes);
+      continue;
+    }
+    uint32_t first = index + 1;
+    uint32_t second = node->offset;
+    float firstNearest;
+    float secondNearest;
+    IntersectNodePacket(&bvh->nodes[first], packet, &firstNearest);
+    IntersectNodePacket(&bvh->nodes[second], packet, &secondNearest);
+    if (firstNearest > secondNearest)
+      std::swap(first, second);
+    stack[top++] = second;
+    stack[top++] = first;
+  }
+}
+
+// Traces a packet against the full level of every mesh and returns the lanes
+// that hit something. With anyHit lanes finish at their first hit and only
+// the mask is meaningful, for shadow and occlusion rays.
+uint32_t RaycastPacket(resources const* resources,
+                       rayPacket* packet,
+                       bool anyHit,
+                       rayHit* hits) {
+  uint32_t found = 0;
+  TraverseBvhPacket(
+      &resources->meshBvh, packet, [&](uint32_t m, uint32_t) {
+        mesh const* mesh = &resources->meshes[m];
+        TraverseBvhPacket(
+            &mesh->faceBvh, packet, [&](uint32_t face, uint32_t lanes) {
+              uint32_t const* index = &mesh->indices[3 * face];
+              float t[kPacketRays];
+              float u[kPacketRays];
+              float v[kPacketRays];
+              lanes &= IntersectTrianglePacket(
+                  packet, mesh->positions[index[0]],
+                  mesh->positions[index[1]], mesh->positions[index[2]], t, u,
+                  v);
+              for (int32_t lane = 0; lane < kPacketRays; lane++) {
+                if (!(lanes >> lane & 1))
+                  continue;
+                found |= 1u << lane;
+                if (anyHit) {
+                  packet->farthest[lane] = -1;
+                  continue;
+                }
+                packet->farthest[lane] = t[lane];
+                hits[lane] = {t[lane], m, face,
+                              vec3(1 - u[lane] - v[lane], u[lane], v[lane])};
+              }
+            });
+      });
+  return found;
+}
+
+// False when every face of the meshlet faces away from the viewer or its
+// bounding sphere is outside the view volume. Back faces count as visible
+// for two sided meshlets.
+bool MeshletVisible(meshlet const* meshlet, bool twoSided) {
+  if (!twoSided && meshlet->axis.z < meshlet->cutoff)
+    return false;
+  for (int32_t i = 0; i < 3; i++) {
+    if (meshlet->center[i] - meshlet->radius > 1.f ||
+        meshlet->center[i] + meshlet->radius < -1.f)
+      return false;
+  }
+  return true;
+}
+
+// Geometric error in pixels up to which a coarser level of detail is drawn.
+const float kLodPixels = 1.f;
+
+// Picks the coarsest level of detail whose error stays below kLodPixels on
+// screen.
+meshLod const* SelectLod(mesh const* mesh, screen const* screen) {
+  // Model space spans the screen, so a unit covers half of it.
+  float pixelsPerUnit = std::max(screen->width, screen->height) / 2.f;
+  meshLod const* lod = &mesh->lods[0];
+  for (meshLod const& level : mesh->lods) {
+    if (level.error * pixelsPerUnit <= kLodPixels)
+      lod = &level;
+  }
+  return lod;
+}
+
+void Draw(screen* screen, resources* resources, frame const* frame) {
+  if (resources->sceneState != ASSET_READY)
+    return;
+  ShadowPass(resources, frame);
+
+  // Visible items come out of the hierarchies in tree order, sorting them
+  // back keeps meshes grouped by material and meshlets in cache order.
+  arena* arena = &screen->arenas->main;
+  uint32_t* meshes = ArenaArray<uint32_t>(arena, resources->meshes.size());
+  uint32_t meshCount = 0;
+  CullBvh(&resources->meshBvh, [&](uint32_t m) { meshes[meshCount++] = m; });
+  std::sort(meshes, meshes + meshCount);
+
+  // Transparent meshes go last so that they are tested against all of the
+  // opaque depth. They are two sided, back faces are lit as seen from the
+  // viewer.
+  for (int32_t pass = 0; pass < 2; pass++) {
+    for (uint32_t* m = meshes; m < meshes + meshCount; m++) {
+      mesh& mesh = resources->meshes[*m];
+      material const* material = mesh.material->state == ASSET_READY
+                                     ? mesh.material
+                                     : resources->placeholder;
+      bool transparent = material->transparent;
+      if (transparent != (pass == 1))
+        continue;
+      UpdateLightCache(&mesh, frame);
+
+      meshLod const* lod = SelectLod(&mesh, screen);
+      uint32_t* meshlets = ArenaArray<uint32_t>(arena, lod->meshletCount);
+      uint32_t meshletCount = 0;
+      CullBvh(&lod->meshletBvh,
+              [&](uint32_t k) { meshlets[meshletCount++] = k; });
+      std::sort(meshlets, meshlets + meshletCount);
+      for (uint32_t* k = meshlets; k < meshlets + meshletCount; k++) {
+        meshlet const& meshlet = mesh.meshlets[lod->firstMeshlet + *k];
+        if (!MeshletVisible(&meshlet, transparent))
+          continue;
+        for (size_t i = meshlet.firstFace;
+             i < meshlet.firstFace + meshlet.faceCount; i++) {
+          vec3 normal = FaceNormal(&mesh, i);
+          float side = normal.z < 0.f ? -1.f : 1.f;
+          if (side < 0 && !transparent)
+            continue;
+          vec3 center(0);
+          if (side < 0)
+            center = (mesh.positions[mesh.indices[3 * i]] +
+                      mesh.positions[mesh.indices[3 * i + 1]] +
+                      mesh.positions[mesh.indices[3 * i + 2]]) /
+                     3.f;
+
+          vertex vertices[3];
+          for (int32_t j = 0; j < 3; j++) {
+            uint32_t index = mesh.indices[3 * i + j];
+            vertex* v = &vertices[j];
+            v->position = mesh.positions[index];
+            v->screen = vec3((v->position.x + 1.f) * screen->width / 2.f,
+                             (v->position.y + 1.f) * screen->height / 2.f,
+                             (v->position.z + 1.f) * screen->depth / 2.f);
+            v->normal = side * (frame->shading == SHADE_FACE
+                                    ? normal
+                                    : mesh.normals[index]);
+            v->tangent = mesh.tangents[index];
+            v->bitangent = mesh.bitangents[index];
+            v->uv = mesh.uvs[index];
+            // The cached terms are for front faces, back faces are lit with
+            // their flipped normal where the cache would have been.
+            if (frame->shading != SHADE_PIXEL && side < 0)
+              v->light = EvaluateLights(
+                  frame->lights,
+                  frame->shading == SHADE_FACE ? center : v->position,
+                  v->normal, frame->lights->unshadowed);
+            else if (frame->shading == SHADE_FACE)
+              v->light = mesh.lightCache.terms[i];
+            else if (frame->shading == SHADE_VERTEX)
+              v->light = mesh.lightCache.terms[index];
+          }
+
+          DrawTriangle(screen, frame, &vertices[0], &vertices[1], &vertices[2],
+                       material);
+        }
+      }
+    }
+  }
+}
+
+// Rows of the framebuffer split into one band per hardware thread.
+struct rowBands {
+  int32_t count;
+  int32_t rows;
+  int32_t height;
+};
+
+// Threads of the worker pool, one per hardware thread up to kMaxWorkers.
+int32_t WorkerCount() {
+  return std::max(
+      1, std::min<int32_t>(std::thread::hardware_concurrency(), kMaxWorkers));
+}
+
+void WorkerLoop(workerPool* pool, int32_t worker) {
+  uint32_t seen = 0;
+  std::unique_lock<std::mutex> lock(pool->lock);
+  while (true) {
+    pool->wake.wait(lock, [&] {
+      return pool->stopping || pool->generation != seen;
+    });
+    if (pool->stopping)
+      return;
+    seen = pool->generation;
+    if (worker >= pool->jobWorkers)
+      continue;
+    lock.unlock();
+    pool->run(pool->job, worker);
+    lock.lock();
+    if (--pool->pending == 0)
+      pool->done.notify_one();
+  }
+}
+
+void StartWorkers(workerPool* pool) {
+  pool->count = WorkerCount();
+  for (int32_t i = 0; i < pool->count; i++)
+    pool->threads[i] = std::thread(WorkerLoop, pool, i);
+}
+
+void StopWorkers(workerPool* pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->lock);
+    pool->stopping = true;
+  }
+  pool->wake.notify_all();
+  for (int32_t i = 0; i < pool->count; i++)
+    pool->threads[i].join();
+}
+
+// Calls job(i) for i below workers on the pool and waits for all of them. A
+// single worker runs on the calling thread. The job stays on the caller's
+// stack, nothing is allocated.
+template <typename Job>
+void RunWorkers(workerPool* pool, int32_t workers, Job& job) {
+  if (workers == 1) {
+    job(0);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(pool->lock);
+  pool->run = [](void* job, int32_t worker) { (*(Job*)job)(worker); };
+  pool->job = &job;
+  pool->jobWorkers = workers;
+  pool->pending = workers;
+  pool->generation++;
+  pool->wake.notify_all();
+  pool->done.wait(lock, [pool] { return pool->pending == 0; });
+}
+
+// Splits height rows into bands of at least minRows rows.
+rowBands SplitRows(int32_t height, int32_t minRows) {
+  rowBands bands;
+  bands.height = height;
+  bands.count = std::max(1, std::min(WorkerCount(), height / minRows));
+  bands.rows = std::max(1, (height + bands.count - 1) / bands.count);
+  // Rounding rows up can leave trailing bands with nothing to do.
+  bands.count = std::max(1, (height + bands.rows - 1) / bands.rows);
+  return bands;
+}
+
+void BandRows(rowBands const* bands, int32_t i, int32_t* begin, int32_t* end) {
+  *begin = i * bands->rows;
+  *end = std::min(*begin + bands->rows, bands->height);
+}
+
+// Calls band(begin, end, i) for every band, band i on worker i.
+template <typename Band>
+void RunBands(workerPool* workers, rowBands const* bands, Band band) {
+  auto job = [&](int32_t i) {
+    int32_t begin;
+    int32_t end;
+    BandRows(bands, i, &begin, &end);
+    band(begin, end, i);
+  };
+  RunWorkers(workers, bands->count, job);
+}
+
+// Calls tile(x0, y0, x1, y1) for every square of size pixels covering width
+// by height, on every worker. Workers take tiles off a shared counter so that
+// costly tiles balance out.
+template <typename Tile>
+void RunTiles(workerPool* workers,
+              int32_t width,
+              int32_t height,
+              int32_t size,
+              Tile tile) {
+  int32_t tilesX = (width + size - 1) / size;
+  int32_t tilesY = (height + size - 1) / size;
+  std::atomic<int32_t> next(0);
+  auto job = [&](int32_t) {
+    for (int32_t i = next++; i < tilesX * tilesY; i = next++) {
+      int32_t x0 = i % tilesX * size;
+      int32_t y0 = i / tilesX * size;
+      tile(x0, y0, std::min(x0 + size, width), std::min(y0 + size, height));
+    }
+  };
+  RunWorkers(workers, workers->count, job);
+}
+
+// Steps Antialias() walks along an edge in each direction to find its ends.
+const int32_t kEdgeSearch = 8;
+
+// Writes the luma of a row of pixels.
+void LumaRow(color const* row, int32_t width, uint8_t* luma) {
+  int32_t x = 0;
+#if defined(__SSE2__)
+  // 16 pixels at a time, channels are weighted in the 32 bit lanes of each
+  // pixel where the products cannot overflow 16 bits.
+  __m128i mask = _mm_set1_epi32(0xFF);
+  __m128i weightRed = _mm_set1_epi32(77);
+  __m128i weightGreen = _mm_set1_epi32(150);
+  __m128i weightBlue = _mm_set1_epi32(29);
+  for (; x + 16 <= width; x += 16) {
+    __m128i lumas[4];
+    for (int32_t i = 0; i < 4; i++) {
+      __m128i pixels = _mm_loadu_si128((__m128i const*)(row + x + 4 * i));
+      __m128i red = _mm_srli_epi32(pixels, 24);
+      __m128i green = _mm_and_si128(_mm_srli_epi32(pixels, 16), mask);
+      __m128i blue = _mm_and_si128(_mm_srli_epi32(pixels, 8), mask);
+      __m128i sum = _mm_add_epi16(
+          _mm_add_epi16(_mm_mullo_epi16(red, weightRed),
+                        _mm_mullo_epi16(green, weightGreen)),
+          _mm_mullo_epi16(blue, weightBlue));
+      lumas[i] = _mm_srli_epi32(sum, 8);
+    }
+    __m128i low = _mm_packs_epi32(lumas[0], lumas[1]);
+    __m128i high = _mm_packs_epi32(lumas[2], lumas[3]);
+    _mm_storeu_si128((__m128i*)(luma + x), _mm_packus_epi16(low, high));
+  }
+#endif
+  for (; x < width; x++)
+    luma[x] = (row[x].red * 77 + row[x].green * 150 + row[x].blue * 29) >> 8;
+}
+
+// Flags pixels of a row whose local contrast is worth antialiasing, given the
+// luma of the row and the ones above and below. The first and last columns
+// are never flagged.
+void EdgeRow(uint8_t const* lumaN,
+             uint8_t const* lumaM,
+             uint8_t const* lumaS,
+             int32_t width,
+             uint8_t* edges) {
+  edges[0] = 0;
+  edges[width - 1] = 0;
+  int32_t x = 1;
+#if defined(__SSE2__)
+  __m128i zero = _mm_setzero_si128();
+  __m128i minimum = _mm_set1_epi8(21);
+  __m128i sixth = _mm_set1_epi16(43);
+  for (; x + 17 <= width; x += 16) {
+    __m128i m = _mm_loadu_si128((__m128i const*)(lumaM + x));
+    __m128i n = _mm_loadu_si128((__m128i const*)(lumaN + x));
+    __m128i s = _mm_loadu_si128((__m128i const*)(lumaS + x));
+    __m128i w = _mm_loadu_si128((__m128i const*)(lumaM + x - 1));
+    __m128i e = _mm_loadu_si128((__m128i const*)(lumaM + x + 1));
+    __m128i highest = _mm_max_epu8(
+        _mm_max_epu8(_mm_max_epu8(n, s), _mm_max_epu8(w, e)), m);
+    __m128i lowest = _mm_min_epu8(
+        _mm_min_epu8(_mm_min_epu8(n, s), _mm_min_epu8(w, e)), m);
+    __m128i low = _mm_srli_epi16(
+        _mm_mullo_epi16(_mm_unpacklo_epi8(highest, zero), sixth), 8);
+    __m128i high = _mm_srli_epi16(
+        _mm_mullo_epi16(_mm_unpackhi_epi8(highest, zero), sixth), 8);
+    __m128i threshold = _mm_max_epu8(_mm_packus_epi16(low, high), minimum);
+    __m128i range = _mm_subs_epu8(highest, lowest);
+    // range >= threshold exactly when max(range, threshold) == range.
+    __m128i flags =
+        _mm_cmpeq_epi8(_mm_max_epu8(range, threshold), range);
+    _mm_storeu_si128((__m128i*)(edges + x), flags);
+  }
+#endif
+  for (; x < width - 1; x++) {
+    uint8_t highest = std::max(std::max(std::max(lumaN[x], lumaS[x]),
+                                        std::max(lumaM[x - 1], lumaM[x + 1])),
+                               lumaM[x]);
+    uint8_t lowest = std::min(std::min(std::min(lumaN[x], lumaS[x]),
+                                       std::min(lumaM[x - 1], lumaM[x + 1])),
+                              lumaM[x]);
+    // Contrast of at least 1/6 of the brightest luma and 1/12 of full range.
+    uint8_t threshold = std::max<uint8_t>(21, highest * 43 >> 8);
+    edges[x] = highest - lowest >= threshold;
+  }
+}
+
+// Luma and colors of the rows around a band of the framebuffer, taken before
+// any band is written so neighbouring bands read the original image.
+struct bandHalo {
+  uint8_t* luma;
+  color* above;
+  color* below;
+};
+
+// Luma rows kept around the current one, kEdgeSearch on each side.
+const int32_t kLumaRows = 2 * kEdgeSearch + 1;
+
+// Antialiases rows [begin, end) in place. Original luma of the rows within
+// kEdgeSearch of the current one and original colors of the current and
+// previous rows are kept aside, so only pixels already finished are written.
+void AntialiasBand(screen* screen,
+                   int32_t begin,
+                   int32_t end,
+                   bandHalo const* halo,
+                   arena* arena) {
+  int32_t width = screen->width;
+  uint8_t* ring = ArenaArray<uint8_t>(arena, kLumaRows * width);
+  color* rows = ArenaArray<color>(arena, 2 * width);
+  uint8_t* edges = ArenaArray<uint8_t>(arena, width);
+
+  // Luma of row r, from the halo outside the band and the ring inside it.
+  auto luma = [&](int32_t r) -> uint8_t const* {
+    r = std::min(std::max(r, 0), screen->height - 1);
+    if (r < begin)
+      return &halo->luma[(r - begin + kEdgeSearch) * width];
+    if (r >= end)
+      return &halo->luma[(r - end + kEdgeSearch) * width];
+    return &ring[(r % kLumaRows) * width];
+  };
+  for (int32_t r = begin; r < std::min(begin + kEdgeSearch, end); r++)
+    LumaRow(FrameRow(screen, r), width, &ring[(r % kLumaRows) * width]);
+
+  color const* above = halo->above;
+  for (int32_t y = begin; y < end; y++) {
+    if (y + kEdgeSearch < end)
+      LumaRow(FrameRow(screen, y + kEdgeSearch), width,
+              &ring[((y + kEdgeSearch) % kLumaRows) * width]);
+    color* row = FrameRow(screen, y);
+    color* current = &rows[(y & 1) * width];
+    memcpy(current, row, width * sizeof(color));
+    color const* below = y + 1 < end ? FrameRow(screen, y + 1) : halo->below;
+
+    // Luma of rows y - kEdgeSearch to y + kEdgeSearch.
+    uint8_t const* window[kLumaRows];
+    for (int32_t i = 0; i < kLumaRows; i++)
+      window[i] = luma(y - kEdgeSearch + i);
+    uint8_t const* lumaN = window[kEdgeSearch - 1];
+    uint8_t const* lumaM = window[kEdgeSearch];
+    uint8_t const* lumaS = window[kEdgeSearch + 1];
+    EdgeRow(lumaN, lumaM, lumaS, width, edges);
+    for (int32_t x = 1; x < width - 1; x++) {
+      if (!edges[x])
+        continue;
+      int32_t west = x - 1;
+      int32_t east = x + 1;
+      int32_t n = lumaN[x];
+      int32_t s = lumaS[x];
+      int32_t w = lumaM[west];
+      int32_t e = lumaM[east];
+      int32_t m = lumaM[x];
+      int32_t range = std::max({n, s, w, e, m}) - std::min({n, s, w, e, m});
+
+      int32_t nw = lumaN[west];
+      int32_t ne = lumaN[east];
+      int32_t sw = lumaS[west];
+      int32_t se = lumaS[east];
+      int32_t horizontal = std::abs(nw + ne - 2 * n) +
+                           2 * std::abs(w + e - 2 * m) +
+                           std::abs(sw + se - 2 * s);
+      int32_t vertical = std::abs(nw + sw - 2 * w) +
+                         2 * std::abs(n + s - 2 * m) +
+                         std::abs(ne + se - 2 * e);
+      bool alongX = horizontal >= vertical;
+
+      // Blend towards the neighbour across the edge with the steeper step.
+      int32_t first = alongX ? n : w;
+      int32_t second = alongX ? s : e;
+      bool towardsFirst = std::abs(first - m) >= std::abs(second - m);
+      int32_t other = towardsFirst ? first : second;
+      int32_t gradient = std::abs(other - m);
+      int32_t edge = m + other;
+
+      // Walk both ways along the edge until the luma pair leaves it.
+      int32_t otherX = alongX ? x : (towardsFirst ? west : east);
+      uint8_t const* otherRow = alongX ? (towardsFirst ? lumaN : lumaS) : 0;
+      int32_t distance[2] = {kEdgeSearch, kEdgeSearch};
+      int32_t delta[2] = {0, 0};
+      for (int32_t side = 0; side < 2; side++) {
+        int32_t step = side ? 1 : -1;
+        for (int32_t i = 1; i <= kEdgeSearch; i++) {
+          int32_t pair;
+          if (alongX) {
+            int32_t sx = std::min(std::max(x + step * i, 0), width - 1);
+            pair = lumaM[sx] + otherRow[sx];
+          } else {
+            uint8_t const* lumaRow = window[kEdgeSearch + step * i];
+            pair = lumaRow[x] + lumaRow[otherX];
+          }
+          delta[side] = pair - edge;
+          if (2 * std::abs(delta[side]) >= gradient) {
+            distance[side] = i;
+            break;
+          }
+        }
+      }
+      int32_t nearest = distance[0] < distance[1] ? 0 : 1;
+      float offset = 0;
+      if ((delta[nearest] < 0) != (2 * m < edge))
+        offset = 0.5f - (float)distance[nearest] /
+                            (distance[0] + distance[1]);
+
+      // Single pixel features have no edge to walk, blend them by contrast.
+      float lowpass = (2 * (n + s + w + e) + nw + ne + sw + se) / 12.f;
+      float subpixel = std::min(std::abs(lowpass - m) / range, 1.f);
+      subpixel = (3 - 2 * subpixel) * subpixel * subpixel;
+      offset = std::max(offset, subpixel * subpixel * 0.75f);
+
+      color target;
+      if (alongX)
+        target = towardsFirst ? above[x] : below[x];
+      else
+        target = current[towardsFirst ? west : east];
+      row[x] = ColorRGB(current[x].red + (target.red - current[x].red) * offset,
+                        current[x].green +
+                            (target.green - current[x].green) * offset,
+                        current[x].blue +
+                            (target.blue - current[x].blue) * offset);
+    }
+    above = current;
+  }
+}
+
+// Blends the framebuffer along luma edges in place, FXAA style. Bands of rows
+// run on their own threads.
+void Antialias(screen* screen) {
+  int32_t width = screen->width;
+  rowBands bands = SplitRows(screen->height, kLumaRows);
+
+  arena* arena = &screen->arenas->main;
+  bandHalo* halos = ArenaArray<bandHalo>(arena, bands.count);
+  for (int32_t i = 0; i < bands.count; i++) {
+    int32_t begin;
+    int32_t end;
+    BandRows(&bands, i, &begin, &end);
+    auto clampRow = [&](int32_t r) {
+      return FrameRow(screen, std::min(std::max(r, 0), screen->height - 1));
+    };
+    bandHalo* halo = &halos[i];
+    halo->luma = ArenaArray<uint8_t>(arena, 2 * kEdgeSearch * width);
+    for (int32_t r = 0; r < kEdgeSearch; r++) {
+      LumaRow(clampRow(begin - kEdgeSearch + r), width,
+              &halo->luma[r * width]);
+      LumaRow(clampRow(end + r), width,
+              &halo->luma[(kEdgeSearch + r) * width]);
+    }
+    halo->above = ArenaArray<color>(arena, width);
+    halo->below = ArenaArray<color>(arena, width);
+    memcpy(halo->above, clampRow(begin - 1), width * sizeof(color));
+    memcpy(halo->below, clampRow(end), width * sizeof(color));
+  }
+
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t i) {
+    AntialiasBand(screen, begin, end, &halos[i],
+                  &screen->arenas->workers[i]);
+  });
+}
+
+// Whether the pass maps each channel of a pixel on its own, so a run of them
+// can be baked into one table per channel.
+bool PerChannel(postPass const* pass) {
+  return pass->type == POST_TONEMAP || pass->type == POST_GAMMA ||
+         (pass->type == POST_GRADE && pass->amount == 1);
+}
+
+// Reinhard, scaled so that white stays white.
+float Tonemap(float value, float exposure) {
+  float exposed = value * exposure;
+  return exposed / (1 + exposed) * (1 + exposure) / exposure;
+}
+
+// Maps one channel in [0, 1] through a tone mapping, gamma or grading gain.
+float PostCurve(postPass const* pass, int32_t channel, float value) {
+  switch (pass->type) {
+    case POST_TONEMAP:
+      return Tonemap(value, pass->amount);
+    case POST_GAMMA:
+      return std::pow(value, 1 / pass->amount);
+    case POST_GRADE:
+      return value * pass->tint[channel];
+    default:
+      return value;
+  }
+}
+
+// Applies a run of per pixel passes in a single traversal of the
+// framebuffer. The leading per channel passes are baked into tables over the
+// 256 channel values, when they are the whole run every pixel is three
+// lookups, otherwise each band works through the rest of the run a row at a
+// time on float channels that stay in cache.
+void PostPixels(screen* screen, postPass const* passes, int32_t count) {
+  int32_t leading = 0;
+  while (leading < count && PerChannel(&passes[leading]))
+    leading++;
+
+  float curves[3][256];
+  for (int32_t channel = 0; channel < 3; channel++) {
+    for (int32_t value = 0; value < 256; value++) {
+      float mapped = value / 255.f;
+      for (int32_t i = 0; i < leading; i++)
+        mapped = PostCurve(&passes[i], channel, mapped);
+      curves[channel][value] = mapped;
+    }
+  }
+
+  int32_t width = screen->width;
+  rowBands bands = SplitRows(screen->height, 1);
+  if (leading == count) {
+    uint8_t tables[3][256];
+    for (int32_t channel = 0; channel < 3; channel++) {
+      for (int32_t value = 0; value < 256; value++)
+        tables[channel][value] = glm::clamp(
+            curves[channel][value] * 255.f + 0.5f, 0.f, 255.f);
+    }
+    RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t) {
+      for (int32_t y = begin; y < end; y++) {
+        color* row = FrameRow(screen, y);
+        for (color* pixel = row; pixel < row + width; pixel++) {
+          pixel->red = tables[0][pixel->red];
+          pixel->green = tables[1][pixel->green];
+          pixel->blue = tables[2][pixel->blue];
+        }
+      }
+    });
+    return;
+  }
+
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t i) {
+    float* channels =
+        ArenaArray<float>(&screen->arenas->workers[i], 4 * width);
+    float* red = &channels[0];
+    float* green = &channels[width];
+    float* blue = &channels[2 * width];
+    // Squared horizontal distance from the center, for vignettes.
+    float* columns = &channels[3 * width];
+    for (int32_t x = 0; x < width; x++) {
+      float dx = (x + 0.5f) * 2 / width - 1;
+      columns[x] = dx * dx;
+    }
+    for (int32_t y = begin; y < end; y++) {
+      color* row = FrameRow(screen, y);
+      for (int32_t x = 0; x < width; x++) {
+        red[x] = curves[0][row[x].red];
+        green[x] = curves[1][row[x].green];
+        blue[x] = curves[2][row[x].blue];
+      }
+
+      for (int32_t i = leading; i < count; i++) {
+        postPass const* pass = &passes[i];
+        float amount = pass->amount;
+        switch (pass->type) {
+          case POST_TONEMAP:
+            for (int32_t x = 0; x < width; x++) {
+              red[x] = Tonemap(red[x], amount);
+              green[x] = Tonemap(green[x], amount);
+              blue[x] = Tonemap(blue[x], amount);
+            }
+            break;
+          case POST_GAMMA:
+            for (int32_t x = 0; x < width; x++) {
+              red[x] = std::pow(red[x], 1 / amount);
+              green[x] = std::pow(green[x], 1 / amount);
+              blue[x] = std::pow(blue[x], 1 / amount);
+            }
+            break;
+          case POST_GRADE:
+            for (int32_t x = 0; x < width; x++) {
+              float r = red[x] * pass->tint.x;
+              float g = green[x] * pass->tint.y;
+              float b = blue[x] * pass->tint.z;
+              float luma = r * 0.299f + g * 0.587f + b * 0.114f;
+              red[x] = luma + (r - luma) * amount;
+              green[x] = luma + (g - luma) * amount;
+              blue[x] = luma + (b - luma) * amount;
+            }
+            break;
+          case POST_VIGNETTE: {
+            // Darkens with the squared distance from the center, reaching
+            // 1 - amount in the corners.
+            float dy = (y + 0.5f) * 2 / screen->height - 1;
+            for (int32_t x = 0; x < width; x++) {
+              float factor = 1 - amount * 0.5f * (columns[x] + dy * dy);
+              red[x] *= factor;
+              green[x] *= factor;
+              blue[x] *= factor;
+            }
+            break;
+          }
+          case POST_SHARPEN:
+            break;
+        }
+      }
+
+      for (int32_t x = 0; x < width; x++)
+        row[x] = ColorRGB(glm::clamp(red[x] * 255.f + 0.5f, 0.f, 255.f),
+                          glm::clamp(green[x] * 255.f + 0.5f, 0.f, 255.f),
+                          glm::clamp(blue[x] * 255.f + 0.5f, 0.f, 255.f));
+    }
+  });
+}
+
+// Unsharp mask over the 4 neighbours of every pixel, in place. Like
+// Antialias() each band keeps the original of the previous row and the rows
+// around bands are captured before any is written.
+void Sharpen(screen* screen, float amount) {
+  int32_t width = screen->width;
+  int32_t height = screen->height;
+  rowBands bands = SplitRows(height, 1);
+  color* halos =
+      ArenaArray<color>(&screen->arenas->main, 2 * bands.count * width);
+  for (int32_t i = 0; i < bands.count; i++) {
+    int32_t begin;
+    int32_t end;
+    BandRows(&bands, i, &begin, &end);
+    color const* above =
+        FrameRow(screen, std::min(std::max(begin - 1, 0), height - 1));
+    color const* below = FrameRow(screen, std::min(end, height - 1));
+    std::copy(above, above + width, &halos[2 * i * width]);
+    std::copy(below, below + width, &halos[(2 * i + 1) * width]);
+  }
+
+  // Amount in 8.8 fixed point.
+  int32_t weight = amount * 256 + 0.5f;
+  auto sharpen = [weight](int32_t m, int32_t neighbours) {
+    int32_t value = (m * (256 + 4 * weight) - neighbours * weight + 128) >> 8;
+    return (uint8_t)std::min(std::max(value, 0), 255);
+  };
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t i) {
+    color* rows = ArenaArray<color>(&screen->arenas->workers[i], 2 * width);
+    color const* above = &halos[2 * i * width];
+    for (int32_t y = begin; y < end; y++) {
+      color* row = FrameRow(screen, y);
+      color* current = &rows[(y & 1) * width];
+      std::copy(row, row + width, current);
+      color const* below =
+          y + 1 < end ? FrameRow(screen, y + 1) : &halos[(2 * i + 1) * width];
+      for (int32_t x = 0; x < width; x++) {
+        color n = above[x];
+        color s = below[x];
+        color w = current[std::max(x - 1, 0)];
+        color e = current[std::min(x + 1, width - 1)];
+        row[x] = ColorRGB(
+            sharpen(current[x].red, n.red + s.red + w.red + e.red),
+            sharpen(current[x].green, n.green + s.green + w.green + e.green),
+            sharpen(current[x].blue, n.blue + s.blue + w.blue + e.blue));
+      }
+      above = current;
+    }
+  });
+}
+
+// Runs the chain over the framebuffer. Consecutive per pixel passes share a
+// traversal, only sharpening needs one of its own.
+void PostProcess(screen* screen, postChain const* chain) {
+  int32_t i = 0;
+  while (i < chain->count) {
+    if (chain->passes[i].type == POST_SHARPEN) {
+      Sharpen(screen, chain->passes[i].amount);
+      i++;
+      continue;
+    }
+    int32_t run = i;
+    while (run < chain->count && chain->passes[run].type != POST_SHARPEN)
+      run++;
+    PostPixels(screen, &chain->passes[i], run - i);
+    i = run;
+  }
+}
+
+// Averages the samples of every pixel into the framebuffer. Pixels whose
+// samples all point at one slot are copied without blending.
+void Resolve(screen* screen) {
+  sampleBuffer const* samples = screen->samples;
+  uint32_t empty = 0;
+  for (int32_t s = 0; s < samples->count; s++)
+    empty |= kEmptySlot << (4 * s);
+
+  for (int32_t y = 0; y < screen->height; y++) {
+    color* row = FrameRow(screen, y);
+    for (int32_t x = 0; x < screen->width; x++) {
+      int32_t i = x + y * screen->width;
+      // The nearest sample stands for the pixel in later depth based passes.
+      float const* depth = &samples->depth[i * kMaxSamples];
+      screen->depthbuffer[i] =
+          *std::max_element(depth, depth + samples->count);
+
+      uint32_t slots = samples->slots[i];
+      color const* colors = &samples->colors[i * kMaxSamples];
+      uint32_t first = slots & 0xF;
+      uint32_t uniform = first * (empty / kEmptySlot);
+      if (slots == uniform) {
+        row[x] = first == kEmptySlot ? ColorRGB(0, 0, 0) : colors[first];
+        continue;
+      }
+
+      int32_t red = 0;
+      int32_t green = 0;
+      int32_t blue = 0;
+      for (int32_t s = 0; s < samples->count; s++) {
+        uint32_t slot = slots >> (4 * s) & 0xF;
+        if (slot == kEmptySlot)
+          continue;
+        red += colors[slot].red;
+        green += colors[slot].green;
+        blue += colors[slot].blue;
+      }
+      row[x] = ColorRGB(red / samples->count, green / samples->count,
+                        blue / samples->count);
+    }
+  }
+}
+
+// Tone maps screen->hdr into the framebuffer, four pixels at a time with the
+// same arithmetic as EncodeChannel().
+void ResolveHdr(screen* screen, float exposure) {
+  int32_t width = screen->width;
+  rowBands bands = SplitRows(screen->height, 1);
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t) {
+    for (int32_t y = begin; y < end; y++) {
+      float const* in = (float const*)TargetRow(screen->hdr, y);
+      color* out = FrameRow(screen, y);
+      int32_t x = 0;
+#if defined(__SSE2__)
+      __m128 scale = _mm_set1_ps(exposure);
+      __m128 white = _mm_set1_ps(1 / (kHdrWhite * kHdrWhite));
+      __m128 zero = _mm_setzero_ps();
+      __m128 one = _mm_set1_ps(1);
+      __m128 threshold = _mm_set1_ps(0.0031308f);
+      // A pixel comes out red first, the lane order is reversed to match
+      // color and its alpha cleared.
+      __m128i rgb = _mm_set_epi32(-1, -1, -1, 0);
+      auto encode = [&](__m128 value) {
+        __m128 v = _mm_max_ps(zero, _mm_mul_ps(value, scale));
+        __m128 curved = _mm_mul_ps(v, _mm_add_ps(one, _mm_mul_ps(v, white)));
+        __m128 mapped =
+            _mm_min_ps(one, _mm_div_ps(curved, _mm_add_ps(one, v)));
+        __m128 s1 = _mm_sqrt_ps(mapped);
+        __m128 s2 = _mm_sqrt_ps(s1);
+        __m128 s3 = _mm_sqrt_ps(s2);
+        __m128 curve = _mm_sub_ps(
+            _mm_add_ps(_mm_mul_ps(_mm_set1_ps(0.585122381f), s1),
+                       _mm_mul_ps(_mm_set1_ps(0.783140355f), s2)),
+            _mm_mul_ps(_mm_set1_ps(0.368262736f), s3));
+        __m128 low = _mm_cmplt_ps(mapped, threshold);
+        __m128 encoded = _mm_or_ps(
+            _mm_and_ps(low, _mm_mul_ps(mapped, _mm_set1_ps(12.92f))),
+            _mm_andnot_ps(low, curve));
+        __m128i bytes = _mm_cvttps_epi32(_mm_add_ps(
+            _mm_mul_ps(encoded, _mm_set1_ps(255)), _mm_set1_ps(0.5f)));
+        return _mm_and_si128(_mm_shuffle_epi32(bytes, _MM_SHUFFLE(0, 1, 2, 3)),
+                             rgb);
+      };
+      for (; x + 4 <= width; x += 4) {
+        float const* p = in + 4 * x;
+        __m128i low = _mm_packs_epi32(encode(_mm_load_ps(p)),
+                                      encode(_mm_load_ps(p + 4)));
+        __m128i high = _mm_packs_epi32(encode(_mm_load_ps(p + 8)),
+                                       encode(_mm_load_ps(p + 12)));
+        _mm_store_si128((__m128i*)(out + x), _mm_packus_epi16(low, high));
+      }
+#endif
+      for (; x < width; x++)
+        out[x] = EncodeRadiance(
+            vec3(in[4 * x], in[4 * x + 1], in[4 * x + 2]), exposure);
+    }
+  });
+}
+
+// Pairs of opposite taps AmbientOcclusion() compares with every pixel.
+const int32_t kSsaoPairs = 6;
+
+// Distance of the outer taps from the pixel, in model units across the
+// screen.
+const float kSsaoRadius = 0.04f;
+
+// Taps whose depth differs from the pixel by more than this, in model units,
+// lie on another surface and are left out.
+const float kSsaoRange = 0.1f;
+
+// How far the midpoint of a pair may sit in front of the pixel, in model
+// units, before the pixel is fully occluded by that pair.
+const float kSsaoCrease = 0.015f;
+
+// Occlusion of the pixel at x in a half resolution depth row, averaged over
+// pairs of taps. A pair occludes when the midpoint between its taps is in
+// front of the pixel, so planes of any slope stay unoccluded and only
+// crevices darken.
+float SsaoPixel(float const* depth,
+                int32_t width,
+                int32_t height,
+                int32_t x,
+                int32_t y,
+                int32_t const* offsetX,
+                int32_t const* offsetY,
+                float scale) {
+  float center = depth[x + y * width];
+  if (center == 0)
+    return 0;
+  float occlusion = 0;
+  for (int32_t k = 0; k < kSsaoPairs; k++) {
+    auto tap = [&](int32_t dx, int32_t dy) {
+      int32_t tx = std::min(std::max(x + dx, 0), width - 1);
+      int32_t ty = std::min(std::max(y + dy, 0), height - 1);
+      return (depth[tx + ty * width] - center) * scale;
+    };
+    float a = tap(offsetX[k], offsetY[k]);
+    float b = tap(-offsetX[k], -offsetY[k]);
+    if (std::abs(a) > kSsaoRange || std::abs(b) > kSsaoRange)
+      continue;
+    // Reciprocals as in the SSE2 path, so both give the same result.
+    occlusion +=
+        std::min(1.f, std::max(0.f, (a + b) * (1.f / (2 * kSsaoCrease))));
+  }
+  return occlusion * (1.f / kSsaoPairs);
+}
+
+// Darkens crevices by how much nearby depth rises around each pixel, scaled
+// by strength. Occlusion is found at half resolution from the nearest depth
+// of every 2x2 pixels, then upsampled with weights that fall off across depth
+// edges so that it does not bleed between surfaces.
+void AmbientOcclusion(screen* screen, float strength) {
+  int32_t width = screen->width;
+  int32_t height = screen->height;
+  int32_t halfWidth = (width + 1) / 2;
+  int32_t halfHeight = (height + 1) / 2;
+  arena* arena = &screen->arenas->main;
+  float* depth = ArenaArray<float>(arena, halfWidth * halfHeight);
+  float* occlusion = ArenaArray<float>(arena, halfWidth * halfHeight);
+  // Depth units to model units.
+  float scale = 2.f / screen->depth;
+
+  // Taps alternate between the full and half radius around a half circle,
+  // their mirror images make up the other half.
+  float radius = kSsaoRadius * std::max(width, height) / 4;
+  int32_t offsetX[kSsaoPairs];
+  int32_t offsetY[kSsaoPairs];
+  int32_t reach = 0;
+  for (int32_t k = 0; k < kSsaoPairs; k++) {
+    float angle = 3.14159265f * (k + .5f) / kSsaoPairs;
+    float r = k & 1 ? radius / 2 : radius;
+    offsetX[k] = std::lround(r * std::cos(angle));
+    offsetY[k] = std::lround(r * std::sin(angle));
+    reach = std::max(reach, std::abs(offsetX[k]));
+  }
+
+  rowBands bands = SplitRows(halfHeight, 1);
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t) {
+    for (int32_t y = begin; y < end; y++) {
+      float const* row0 = screen->depthbuffer + 2 * y * width;
+      float const* row1 = 2 * y + 1 < height ? row0 + width : row0;
+      for (int32_t x = 0; x < halfWidth; x++) {
+        int32_t x1 = std::min(2 * x + 1, width - 1);
+        depth[x + y * halfWidth] = std::max(std::max(row0[2 * x], row0[x1]),
+                                            std::max(row1[2 * x], row1[x1]));
+      }
+    }
+  });
+
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t) {
+    for (int32_t y = begin; y < end; y++) {
+      float* out = &occlusion[y * halfWidth];
+      int32_t x = 0;
+#if defined(__SSE2__)
+      // Four pixels at a time where every tap of the row is inside it, rows
+      // of taps are clamped the same way for all lanes.
+      float const* center = &depth[y * halfWidth];
+      __m128 zero = _mm_setzero_ps();
+      __m128 one = _mm_set1_ps(1.f);
+      __m128 range = _mm_set1_ps(kSsaoRange);
+      __m128 sign = _mm_set1_ps(-0.f);
+      __m128 scales = _mm_set1_ps(scale);
+      __m128 crease = _mm_set1_ps(1.f / (2 * kSsaoCrease));
+      x = std::min(reach, halfWidth);
+      for (; x + reach + 4 <= halfWidth; x += 4) {
+        __m128 c = _mm_loadu_ps(center + x);
+        __m128 sum = zero;
+        for (int32_t k = 0; k < kSsaoPairs; k++) {
+          int32_t ya = std::min(std::max(y + offsetY[k], 0), halfHeight - 1);
+          int32_t yb = std::min(std::max(y - offsetY[k], 0), halfHeight - 1);
+          __m128 a = _mm_loadu_ps(&depth[ya * halfWidth + x + offsetX[k]]);
+          __m128 b = _mm_loadu_ps(&depth[yb * halfWidth + x - offsetX[k]]);
+          a = _mm_mul_ps(_mm_sub_ps(a, c), scales);
+          b = _mm_mul_ps(_mm_sub_ps(b, c), scales);
+          __m128 near = _mm_and_ps(
+              _mm_cmple_ps(_mm_andnot_ps(sign, a), range),
+              _mm_cmple_ps(_mm_andnot_ps(sign, b), range));
+          __m128 pair = _mm_mul_ps(_mm_add_ps(a, b), crease);
+          pair = _mm_min_ps(one, _mm_max_ps(zero, pair));
+          sum = _mm_add_ps(sum, _mm_and_ps(near, pair));
+        }
+        sum = _mm_mul_ps(sum, _mm_set1_ps(1.f / kSsaoPairs));
+        // Nothing drawn, nothing occluded.
+        sum = _mm_andnot_ps(_mm_cmpeq_ps(c, zero), sum);
+        _mm_storeu_ps(out + x, sum);
+      }
+      for (; x < halfWidth; x++)
+        out[x] = SsaoPixel(depth, halfWidth, halfHeight, x, y,
+                           offsetX, offsetY, scale);
+      for (x = 0; x < std::min(reach, halfWidth); x++)
+        out[x] = SsaoPixel(depth, halfWidth, halfHeight, x, y,
+                           offsetX, offsetY, scale);
+#else
+      for (; x < halfWidth; x++)
+        out[x] = SsaoPixel(depth, halfWidth, halfHeight, x, y,
+                           offsetX, offsetY, scale);
+#endif
+    }
+  });
+
+  // Every pixel blends the four half resolution pixels around it, bilinear
+  // weights are divided by how far their depth is from the pixel's.
+  rowBands fullBands = SplitRows(height, 1);
+  auto upsample = [&](int32_t begin, int32_t end, int32_t) {
+    for (int32_t y = begin; y < end; y++) {
+      float fy = std::max(0.f, (y - .5f) / 2);
+      int32_t y0 = std::min((int32_t)fy, halfHeight - 1);
+      int32_t y1 = std::min(y0 + 1, halfHeight - 1);
+      float ty = fy - y0;
+      for (int32_t x = 0; x < width; x++) {
+        int32_t pixel = x + y * width;
+        float d = screen->depthbuffer[pixel];
+        if (d == 0)
+          continue;
+        float fx = std::max(0.f, (x - .5f) / 2);
+        int32_t x0 = std::min((int32_t)fx, halfWidth - 1);
+        int32_t x1 = std::min(x0 + 1, halfWidth - 1);
+        float tx = fx - x0;
+        int32_t taps[4] = {x0 + y0 * halfWidth, x1 + y0 * halfWidth,
+                           x0 + y1 * halfWidth, x1 + y1 * halfWidth};
+        // Most of the surface is unoccluded and stays as it is.
+        float any = occlusion[taps[0]] + occlusion[taps[1]] +
+                    occlusion[taps[2]] + occlusion[taps[3]];
+        if (any == 0)
+          continue;
+        float bilinear[4] = {(1 - tx) * (1 - ty), tx * (1 - ty),
+                             (1 - tx) * ty, tx * ty};
+        float total = 0;
+        float weighted = 0;
+        for (int32_t i = 0; i < 4; i++) {
+          float w = bilinear[i] /
+                    (1e-3f + std::abs(depth[taps[i]] - d) * scale);
+          total += w;
+          weighted += w * occlusion[taps[i]];
+        }
+        // 8.8 fixed point light left after occlusion.
+        int32_t light = (1 - strength * weighted / total) * 256 + 0.5f;
+        color* c = &FrameRow(screen, y)[x];
+        *c = ColorRGB(c->red * light >> 8, c->green * light >> 8,
+                      c->blue * light >> 8);
+      }
+    }
+  };
+  RunBands(screen->workers, &fullBands, upsample);
+}
+
+// Side of the square tiles ShadeDeferred() culls lights for.
+const int32_t kLightTile = 16;
+
+// Builds the lights of set that can reach the box from low to high into tile,
+// remap gets the index in tile of every light of set or -1. Ambient and
+// directional lights reach everything, spot lights are culled as points.
+void CullLights(lightSet const* set,
+                vec3 low,
+                vec3 high,
+                lightSet* tile,
+                int32_t* remap) {
+  tile->count = 0;
+  tile->version = set->version;
+  for (int32_t i = 0; i < set->count; i++) {
+    remap[i] = -1;
+    if (set->positional[i] > 0) {
+      vec3 position(set->x[i], set->y[i], set->z[i]);
+      vec3 nearest = glm::clamp(position, low, high);
+      vec3 offset = position - nearest;
+      if (glm::dot(offset, offset) * set->invRangeSq[i] >= 1)
+        continue;
+    }
+    int32_t j = tile->count++;
+    remap[i] = j;
+    tile->colorR[j] = set->colorR[i];
+    tile->colorG[j] = set->colorG[i];
+    tile->colorB[j] = set->colorB[i];
+    tile->x[j] = set->x[i];
+    tile->y[j] = set->y[i];
+    tile->z[j] = set->z[i];
+    tile->positional[j] = set->positional[i];
+    tile->ambient[j] = set->ambient[i];
+    tile->invRangeSq[j] = set->invRangeSq[i];
+    tile->spotX[j] = set->spotX[i];
+    tile->spotY[j] = set->spotY[i];
+    tile->spotZ[j] = set->spotZ[i];
+    tile->cosOuter[j] = set->cosOuter[i];
+    tile->invConeWidth[j] = set->invConeWidth[i];
+    tile->unshadowed[j] = set->unshadowed[i];
+  }
+}
+
+// Lights the G-buffer Draw() wrote in deferred mode. Each tile culls the
+// lights against the bounds of its pixels and only evaluates the ones left,
+// so lighting costs pixels times the lights that reach them.
+void ShadeDeferred(screen* screen, frame const* frame) {
+  gBuffer const* gbuffer = screen->gbuffer;
+  int32_t width = screen->width;
+  int32_t height = screen->height;
+  float scale = 2.f / screen->depth;
+  auto shade = [&](int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+    float nearest = 0;
+    float farthest = FLT_MAX;
+    for (int32_t y = y0; y < y1; y++) {
+      for (int32_t x = x0; x < x1; x++) {
+        float depth = screen->depthbuffer[x + y * width];
+        if (depth > 0) {
+          nearest = std::max(nearest, depth);
+          farthest = std::min(farthest, depth);
+        }
+      }
+    }
+    if (nearest == 0) {
+      for (int32_t y = y0; y < y1; y++) {
+        if (frame->hdr) {
+          float* row = (float*)TargetRow(screen->hdr, y);
+          std::fill(row + 4 * x0, row + 4 * x1, 0.f);
+        } else {
+          std::fill(FrameRow(screen, y) + x0, FrameRow(screen, y) + x1,
+                    color{});
+        }
+      }
+      return;
+    }
+
+    vec3 low(x0 * 2.f / width - 1, y0 * 2.f / height - 1,
+             farthest * scale - 1);
+    vec3 high(x1 * 2.f / width - 1, y1 * 2.f / height - 1,
+              nearest * scale - 1);
+    lightSet lights;
+    int32_t remap[kMaxLights];
+    CullLights(frame->lights, low, high, &lights, remap);
+    int32_t maps[kMaxShadowMaps];
+    for (int32_t i = 0; i < frame->shadowMapCount; i++) {
+      int32_t light = frame->shadowMaps[i].light;
+      maps[i] = light >= 0 ? remap[light] : -1;
+    }
+
+    for (int32_t y = y0; y < y1; y++) {
+      for (int32_t x = x0; x < x1; x++) {
+        int32_t pixel = x + y * width;
+        float depth = screen->depthbuffer[pixel];
+        if (depth == 0) {
+          if (frame->hdr)
+            StoreRadiance(screen, x, y, vec3(0));
+          else
+            FrameRow(screen, y)[x] = color{};
+          continue;
+        }
+        vec3 position((x + .5f) * 2 / width - 1, (y + .5f) * 2 / height - 1,
+                      depth * scale - 1);
+        vec3 normal = UnpackNormal(gbuffer->normals[pixel]);
+
+        float weights[kMaxLights];
+        // Shadowed lights without a map are lit as if unshadowed.
+        for (int32_t i = 0; i < lights.count; i++)
+          weights[i] = 1;
+        for (int32_t i = 0; i < frame->shadowMapCount; i++) {
+          if (maps[i] >= 0)
+            weights[maps[i]] = ShadowVisibility(&frame->shadowMaps[i],
+                                                position, frame->pcf);
+        }
+        vec3 light = EvaluateLights(&lights, position, normal, weights);
+        color albedo = gbuffer->albedo[pixel];
+        vec3 specular(0);
+        if (albedo.alpha)
+          specular = (float)albedo.alpha *
+                     EvaluateSpecular(&lights, position, normal, weights,
+                                      gbuffer->shininess[pixel]);
+        if (frame->hdr)
+          StoreRadiance(screen, x, y,
+                        Radiance(light, albedo.red, albedo.green,
+                                 albedo.blue, specular));
+        else
+          FrameRow(screen, y)[x] =
+              ColorRGB(Shade(light.x, albedo.red, specular.x),
+                       Shade(light.y, albedo.green, specular.y),
+                       Shade(light.z, albedo.blue, specular.z));
+      }
+    }
+  };
+  RunTiles(screen->workers, width, height, kLightTile, shade);
+}
+
+// Composites the transparent fragments Draw() accumulated over the opaque
+// framebuffer and clears the accumulation for the next frame.
+void ResolveTransparency(screen* screen) {
+  oitBuffer* oit = screen->oit;
+  rowBands bands = SplitRows(screen->height, 1);
+  RunBands(screen->workers, &bands, [&](int32_t begin, int32_t end, int32_t) {
+    for (int32_t y = begin; y < end; y++) {
+      color* row = FrameRow(screen, y);
+      for (int32_t x = 0; x < screen->width; x++) {
+        int32_t i = x + y * screen->width;
+        float revealage = oit->revealage[i];
+        if (revealage == 1)
+          continue;
+        float* accum = &oit->accum[4 * i];
+        float cover = (1 - revealage) / std::max(accum[3], 1e-5f);
+        color* c = &row[x];
+        auto blend = [&](float layers, uint8_t background) {
+          return (uint8_t)std::min(255.f,
+                                   layers * cover + background * revealage);
+        };
+        *c = ColorRGB(blend(accum[0], c->red), blend(accum[1], c->green),
+                      blend(accum[2], c->blue));
+        accum[0] = accum[1] = accum[2] = accum[3] = 0;
+        oit->revealage[i] = 1;
+      }
+    }
+  });
+  oit->pending = false;
+}
+
+// Side of the square tiles RayTrace() hands out to its threads, even so that
+// tiles split into whole 2x2 packets.
+const int32_t kRayTile = 16;
+
+// Distance rays travel from a surface before they can hit anything, so that
+// they do not hit the face they left from.
+const float kRayBias = 1e-3f;
+
+// Occluders farther than this from a point do not darken its ambient light.
+const float kAoDistance = 0.25f;
+
+// Deterministic value in [0, 1) for a pixel and sample, so that ray traced
+// frames are reproducible.
+float HashUnit(uint32_t x, uint32_t y, uint32_t i) {
+  uint32_t h = x * 0x8DA6B343u ^ y * 0xD8163841u ^ i * 0xCB1AB31Fu;
+  h ^= h >> 16;
+  h *= 0x7FEB352Du;
+  h ^= h >> 15;
+  h *= 0x846CA68Bu;
+  h ^= h >> 16;
+  return (h >> 8) / 16777216.f;
+}
+
+// Direction around the normal, denser towards it like the light an ambient
+// sky sends to a diffuse surface.
+vec3 CosineDirection(vec3 normal, float u, float v) {
+  vec3 side = std::abs(normal.x) < 0.9f ? vec3(1, 0, 0) : vec3(0, 1, 0);
+  vec3 tangent = glm::normalize(glm::cross(side, normal));
+  vec3 bitangent = glm::cross(normal, tangent);
+  float radius = std::sqrt(u);
+  float angle = 6.2831853f * v;
+  return tangent * (radius * std::cos(angle)) +
+         bitangent * (radius * std::sin(angle)) +
+         normal * std::sqrt(std::max(0.f, 1 - u));
+}
+
+// Shades the 2x2 pixels whose lower left corner is at x, y. Lights the
+// rasterizer shadows with shadow maps get shadow rays instead, ambient lights
+// are scaled by the fraction of occlusion rays that escape.
+void RayTraceQuad(screen* screen,
+                  resources const* resources,
+                  frame const* frame,
+                  int32_t x,
+                  int32_t y) {
+  lightSet const* lights = frame->lights;
+  rayPacket packet;
+  rayHit hits[kPacketRays];
+  for (int32_t lane = 0; lane < kPacketRays; lane++) {
+    int32_t px = x + (lane & 1);
+    int32_t py = y + (lane >> 1);
+    vec3 origin((px + .5f) * 2 / screen->width - 1,
+                (py + .5f) * 2 / screen->height - 1, 1);
+    bool inside = px < screen->width && py < screen->height;
+    SetPacketRay(&packet, lane, origin, vec3(0, 0, -1), inside ? 2 : -1);
+  }
+  uint32_t visible = RaycastPacket(resources, &packet, false, hits);
+
+  struct {
+    vec3 position;
+    vec3 normal;
+    vec3 geometric;
+    // A copy, a later lane may evict a decoded tile.
+    texel texel;
+    material const* material;
+  } surfaces[kPacketRays] = {};
+  for (int32_t lane = 0; lane < kPacketRays; lane++) {
+    if (!(visible >> lane & 1))
+      continue;
+    mesh const* mesh = &resources->meshes[hits[lane].mesh];
+    material const* material = mesh->material->state == ASSET_READY
+                                   ? mesh->material
+                                   : resources->placeholder;
+    vertex vertices[3];
+    for (int32_t j = 0; j < 3; j++) {
+      uint32_t index = mesh->indices[3 * hits[lane].face + j];
+      vertices[j].position = mesh->positions[index];
+      vertices[j].normal = mesh->normals[index];
+      vertices[j].tangent = mesh->tangents[index];
+      vertices[j].bitangent = mesh->bitangents[index];
+      vertices[j].uv = mesh->uvs[index];
+    }
+    vec3 b = hits[lane].baricenter;
+    vec2 uv = vertices[0].uv * b.x + vertices[1].uv * b.y +
+              vertices[2].uv * b.z;
+    surfaces[lane].material = material;
+    surfaces[lane].texel = *SampleMaterial(material, uv, 0);
+    surfaces[lane].position = vertices[0].position * b.x +
+                              vertices[1].position * b.y +
+                              vertices[2].position * b.z;
+    surfaces[lane].normal = glm::normalize(
+        SurfaceNormal(&vertices[0], &vertices[1], &vertices[2], material,
+                      &surfaces[lane].texel, b));
+    // Faces seen from behind are lit from the side the ray came from.
+    vec3 geometric = FaceNormal(mesh, hits[lane].face);
+    surfaces[lane].geometric = geometric.z < 0 ? -geometric : geometric;
+  }
+
+  float weights[kPacketRays][kMaxLights];
+  bool ambient = false;
+  for (int32_t i = 0; i < lights->count; i++) {
+    ambient |= lights->ambient[i] > 0;
+    for (int32_t lane = 0; lane < kPacketRays; lane++)
+      weights[lane][i] = 1;
+    if (lights->unshadowed[i] > 0)
+      continue;
+    for (int32_t lane = 0; lane < kPacketRays; lane++) {
+      // Lanes that missed have no surface to cast from.
+      if (!(visible >> lane & 1)) {
+        SetPacketRay(&packet, lane, vec3(0), vec3(0, 0, -1), -1);
+        continue;
+      }
+      vec3 position = surfaces[lane].position;
+      vec3 toLight = vec3(lights->x[i], lights->y[i], lights->z[i]) -
+                     lights->positional[i] * position;
+      float distance = lights->positional[i] > 0
+                           ? glm::length(toLight)
+                           : 4 * resources->radius + 4;
+      toLight = glm::normalize(toLight);
+      bool lit = glm::dot(toLight, surfaces[lane].geometric) > 0;
+      SetPacketRay(&packet, lane, position + kRayBias * toLight, toLight,
+                   lit ? distance - kRayBias : -1);
+    }
+    uint32_t shadowed = RaycastPacket(resources, &packet, true, hits);
+    for (int32_t lane = 0; lane < kPacketRays; lane++) {
+      if (shadowed >> lane & 1)
+        weights[lane][i] = 0;
+    }
+  }
+
+  if (ambient && frame->aoRays > 0) {
+    int32_t open[kPacketRays] = {};
+    for (int32_t r = 0; r < frame->aoRays; r++) {
+      for (int32_t lane = 0; lane < kPacketRays; lane++) {
+        if (!(visible >> lane & 1)) {
+          SetPacketRay(&packet, lane, vec3(0), vec3(0, 0, -1), -1);
+          continue;
+        }
+        uint32_t px = x + (lane & 1);
+        uint32_t py = y + (lane >> 1);
+        vec3 normal = surfaces[lane].geometric;
+        vec3 direction = CosineDirection(normal, HashUnit(px, py, 2 * r),
+                                         HashUnit(px, py, 2 * r + 1));
+        SetPacketRay(&packet, lane,
+                     surfaces[lane].position + kRayBias * normal, direction,
+                     kAoDistance);
+      }
+      uint32_t occluded = RaycastPacket(resources, &packet, true, hits);
+      for (int32_t lane = 0; lane < kPacketRays; lane++)
+        open[lane] += !(occluded >> lane & 1);
+    }
+    for (int32_t i = 0; i < lights->count; i++) {
+      if (lights->ambient[i] == 0)
+        continue;
+      for (int32_t lane = 0; lane < kPacketRays; lane++)
+        weights[lane][i] = open[lane] / (float)frame->aoRays;
+    }
+  }
+
+  for (int32_t lane = 0; lane < kPacketRays; lane++) {
+    int32_t px = x + (lane & 1);
+    int32_t py = y + (lane >> 1);
+    if (px >= screen->width || py >= screen->height)
+      continue;
+    int32_t pixel = px + py * screen->width;
+    if (!(visible >> lane & 1)) {
+      if (frame->hdr)
+        StoreRadiance(screen, px, py, vec3(0));
+      else
+        FrameRow(screen, py)[px] = color{};
+      screen->depthbuffer[pixel] = 0;
+      continue;
+    }
+    auto const& surface = surfaces[lane];
+    vec3 light = EvaluateLights(lights, surface.position, surface.normal,
+                                weights[lane]);
+    vec3 specular(0);
+    if (surface.material->specular)
+      specular = (float)surface.texel.specular *
+                 EvaluateSpecular(lights, surface.position, surface.normal,
+                                  weights[lane], surface.material->shininess);
+    if (frame->hdr)
+      StoreRadiance(screen, px, py,
+                    Radiance(light, surface.texel.red, surface.texel.green,
+                             surface.texel.blue, specular));
+    else
+      FrameRow(screen, py)[px] =
+          ColorRGB(Shade(light.x, surface.texel.red, specular.x),
+                   Shade(light.y, surface.texel.green, specular.y),
+                   Shade(light.z, surface.texel.blue, specular.z));
+    screen->depthbuffer[pixel] =
+        (surface.position.z + 1.f) * screen->depth / 2.f;
+  }
+}
+
+// Renders the full level of every mesh by casting a ray through each pixel
+// center, into the same framebuffer and depthbuffer the rasterizer writes.
+void RayTrace(screen* screen, resources const* resources, frame const* frame) {
+  RunTiles(screen->workers, screen->width, screen->height, kRayTile,
+           [&](int32_t x0, int32_t y0, int32_t x1, int32_t y1) {
+             for (int32_t y = y0; y < y1; y += 2) {
+               for (int32_t x = x0; x < x1; x += 2)
+                 RayTraceQuad(screen, resources, frame, x, y);
+             }
+           });
+}
+
+// Rounds to the nearest half, values beyond its range become infinity and
+// values below its normal range zero.
+uint16_t FloatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint32_t sign = bits >> 16 & 0x8000;
+  int32_t exponent = (int32_t)(bits >> 23 & 0xFF) - 127 + 15;
+  uint32_t mantissa = bits & 0x7FFFFF;
+  if (exponent <= 0)
+    return sign;
+  if (exponent >= 31)
+    return sign | 0x7C00;
+  // A carry out of the mantissa correctly bumps the exponent.
+  return (sign | exponent << 10 | mantissa >> 13) + (mantissa >> 12 & 1);
+}
+
+// Converts a PIXEL_RGBA8 target into another target of the same size in any
+// format. A target of the same format is a copy of rows.
+void StoreTarget(workerPool* workers,
+                 renderTarget const* source,
+                 renderTarget* destination) {
+  int32_t width = source->width;
+  uint16_t halves[256];
+  for (int32_t i = 0; i < 256; i++)
+    halves[i] = FloatToHalf(i / 255.f);
+
+  rowBands bands = SplitRows(source->height, 1);
+  RunBands(workers, &bands, [&](int32_t begin, int32_t end, int32_t) {
+    for (int32_t y = begin; y < end; y++) {
+      color const* in = (color const*)TargetRow(source, y);
+      uint8_t* out = TargetRow(destination, y);
+      int32_t x = 0;
+      switch (destination->format) {
+        case PIXEL_RGBA8:
+          memcpy(out, in, width * sizeof(color));
+          break;
+        case PIXEL_BGRA8: {
+          // Red and blue swap places within every 32 bit pixel.
+          uint32_t* pixels = (uint32_t*)out;
+#if defined(__SSE2__)
+          __m128i keep = _mm_set1_epi32(0x00FF00FF);
+          for (; x + 4 <= width; x += 4) {
+            __m128i p = _mm_load_si128((__m128i const*)(in + x));
+            __m128i red = _mm_and_si128(_mm_srli_epi32(p, 16),
+                                        _mm_set1_epi32(0xFF00));
+            __m128i blue = _mm_slli_epi32(_mm_srli_epi32(p, 8), 24);
+            p = _mm_or_si128(_mm_and_si128(p, keep), _mm_or_si128(red, blue));
+            _mm_storeu_si128((__m128i*)(pixels + x), p);
+          }
+#endif
+          for (; x < width; x++) {
+            uint32_t p;
+            memcpy(&p, &in[x], sizeof(p));
+            pixels[x] = (p & 0x00FF00FF) | (p >> 16 & 0xFF00) |
+                        (p >> 8 & 0xFF) << 24;
+          }
+          break;
+        }
+        case PIXEL_RGB565: {
+          uint16_t* pixels = (uint16_t*)out;
+          for (; x < width; x++)
+            pixels[x] = (in[x].red >> 3) << 11 | (in[x].green >> 2) << 5 |
+                        in[x].blue >> 3;
+          break;
+        }
+        case PIXEL_RGBA16F: {
+          uint16_t* pixels = (uint16_t*)out;
+          for (; x < width; x++) {
+            pixels[4 * x] = halves[in[x].red];
+            pixels[4 * x + 1] = halves[in[x].green];
+            pixels[4 * x + 2] = halves[in[x].blue];
+            pixels[4 * x + 3] = halves[in[x].alpha];
+          }
+          break;
+        }
+        case PIXEL_RGBA32F: {
+          float* pixels = (float*)out;
+#if defined(__SSE2__)
+          // Bytes of a pixel widened to 32 bits come out alpha first, the
+          // lane order is reversed to start with red.
+          __m128i zero = _mm_setzero_si128();
+          __m128 scale = _mm_set1_ps(1 / 255.f);
+          for (; x + 4 <= width; x += 4) {
+            __m128i p = _mm_load_si128((__m128i const*)(in + x));
+            __m128i low = _mm_unpacklo_epi8(p, zero);
+            __m128i high = _mm_unpackhi_epi8(p, zero);
+            __m128i pair[4] = {
+                _mm_unpacklo_epi16(low, zero), _mm_unpackhi_epi16(low, zero),
+                _mm_unpacklo_epi16(high, zero), _mm_unpackhi_epi16(high, zero)};
+            for (int32_t i = 0; i < 4; i++) {
+              __m128i rgba =
+                  _mm_shuffle_epi32(pair[i], _MM_SHUFFLE(0, 1, 2, 3));
+              _mm_storeu_ps(pixels + 4 * (x + i),
+                            _mm_mul_ps(_mm_cvtepi32_ps(rgba), scale));
+            }
+          }
+#endif
+          for (; x < width; x++) {
+            pixels[4 * x] = in[x].red / 255.f;
+            pixels[4 * x + 1] = in[x].green / 255.f;
+            pixels[4 * x + 2] = in[x].blue / 255.f;
+            pixels[4 * x + 3] = in[x].alpha / 255.f;
+          }
+          break;
+        }
+      }
+    }
+  });
+}
+
+void Render(screen* screen, resources* resources, frame const* frame) {
+  if (resources->pages)
+    UpdatePages(resources);
+  int32_t pixels = screen->height * screen->width;
+  // Ray tracing and deferred shading write every pixel once and ignore
+  // multisampling.
+  bool multisample = screen->samples->count > 1 && !frame->rayTrace &&
+                     !frame->deferred;
+  // Samples are tone mapped as they are shaded, see frame::hdr.
+  bool hdr = frame->hdr && !multisample;
+  renderTarget* target = hdr ? screen->hdr : screen->framebuffer;
+  if (frame->rayTrace) {
+    if (resources->sceneState == ASSET_READY) {
+      RayTrace(screen, resources, frame);
+    } else {
+      ClearTarget(target);
+      memset(screen->depthbuffer, 0x00, pixels * sizeof(float));
+    }
+  } else if (multisample) {
+    memset(screen->samples->slots, 0xFF, pixels * sizeof(uint32_t));
+    memset(screen->samples->depth, 0x00,
+           pixels * kMaxSamples * sizeof(float));
+  } else {
+    ClearTarget(target);
+    memset(screen->depthbuffer, 0x00, pixels * sizeof(float));
+  }
+
+  if (!frame->rayTrace)
+    Draw(screen, resources, frame);
+  if (frame->deferred && !frame->rayTrace)
+    ShadeDeferred(screen, frame);
+
+  if (multisample)
+    Resolve(screen);
+  if (hdr)
+    ResolveHdr(screen, frame->exposure);
+  if (frame->ambientOcclusion)
+    AmbientOcclusion(screen, frame->ambientOcclusionStrength);
+  if (screen->oit->pending)
+    ResolveTransparency(screen);
+  if (frame->postProcess)
+    PostProcess(screen, frame->post);
+  if (frame->antialias)
+    Antialias(screen);
+}
+
+// Renders the loaded scene offscreen with every rasterizer and prints the
+// average frame time of each.
+void Benchmark(screen* screen,
+               resources* resources,
+               frame* frame,
+               int32_t frames) {
+  struct {
+    rasterMode mode;
+    char const* name;
+  } modes[] = {
+      {RASTER_BLOCKS, "blocks"},
+      {RASTER_SCANLINE, "scanline"},
+      {RASTER_AUTO, "auto"},
+  };
+  for (auto const& mode : modes) {
+    frame->raster = mode.mode;
+    Render(screen, resources, frame);
+    ResetFrameArenas(screen->arenas);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int32_t i = 0; i < frames; i++) {
+      Render(screen, resources, frame);
+      ResetFrameArenas(screen->arenas);
+    }
+    std::chrono::duration<double, std::milli> elapsed =
+        std::chrono::steady_clock::now() - start;
+    std::cout << mode.name << ": " << elapsed.count() / frames
+              << " ms/frame" << std::endl;
+  }
+
+  frame->deferred = true;
+  auto start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++) {
+    Render(screen, resources, frame);
+    ResetFrameArenas(screen->arenas);
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "deferred: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+  frame->deferred = false;
+
+  frame->rayTrace = true;
+  start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++) {
+    Render(screen, resources, frame);
+    ResetFrameArenas(screen->arenas);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "raytrace: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+  frame->rayTrace = false;
+
+  bool hdr = frame->hdr;
+  frame->hdr = true;
+  start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++) {
+    Render(screen, resources, frame);
+    ResetFrameArenas(screen->arenas);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "hdr: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+  frame->hdr = hdr;
+
+  start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++)
+    ResolveHdr(screen, frame->exposure);
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "tonemap: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+
+  start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++) {
+    AmbientOcclusion(screen, frame->ambientOcclusionStrength);
+    ResetFrameArenas(screen->arenas);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "ssao: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+
+  start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++) {
+    PostProcess(screen, frame->post);
+    ResetFrameArenas(screen->arenas);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "post: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+
+  start = std::chrono::steady_clock::now();
+  for (int32_t i = 0; i < frames; i++) {
+    Antialias(screen);
+    ResetFrameArenas(screen->arenas);
+  }
+  elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << "antialias: " << elapsed.count() / frames << " ms/frame"
+            << std::endl;
+
+  struct {
+    pixelFormat format;
+    char const* name;
+  } formats[] = {
+      {PIXEL_RGBA8, "rgba8"},     {PIXEL_BGRA8, "bgra8"},
+      {PIXEL_RGB565, "rgb565"},   {PIXEL_RGBA16F, "rgba16f"},
+      {PIXEL_RGBA32F, "rgba32f"},
+  };
+  for (auto const& format : formats) {
+    renderTarget target;
+    CreateRenderTarget(&target, screen->width, screen->height, format.format,
+                       0);
+    start = std::chrono::steady_clock::now();
+    for (int32_t i = 0; i < frames; i++)
+      StoreTarget(screen->workers, screen->framebuffer, &target);
+    elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "store " << format.name << ": " << elapsed.count() / frames
+              << " ms/frame" << std::endl;
+    FreeRenderTarget(&target);
+  }
+}
+
+// Casts a ray into the scene through the center of a window pixel and prints
+// what it hits. The window is flipped, so rows count from the bottom.
+void Pick(screen const* screen, resources const* resources, int x, int y) {
+  vec3 origin((x + .5f) * 2 / screen->width - 1,
+              (screen->height - y - .5f) * 2 / screen->height - 1, 1);
+  rayHit hit;
+  if (!Raycast(resources, origin, vec3(0, 0, -1), 2, &hit)) {
+    std::cout << "picked nothing" << std::endl;
+    return;
+  }
+  vec3 point = origin + hit.distance * vec3(0, 0, -1);
+  std::cout << "picked mesh " << hit.mesh << " face " << hit.face << " at ("
+            << point.x << ", " << point.y << ", " << point.z << ")"
+            << std::endl;
+}
+
+void EventLoop(screen* screen,
+               resources* resources,
+               frame* frame,
+               SDL_Renderer* renderer,
+               SDL_Texture* texture) {
+  bool running = true;
+  while (running) {
+    SDL_Event event;
+    while (SDL_PollEvent(&event)) {
+      switch (event.type) {
+        case SDL_QUIT:
+          running = false;
+          break;
+        case SDL_KEYDOWN:
+          // Cycles through 1, 4 and 8 samples per pixel.
+          if (event.key.keysym.sym == SDLK_m) {
+            int32_t* count = &screen->samples->count;
+            *count = *count == 1 ? 4 : *count == 4 ? 8 : 1;
+          } else if (event.key.keysym.sym == SDLK_f) {
+            frame->antialias = !frame->antialias;
+          } else if (event.key.keysym.sym == SDLK_p) {
+            frame->postProcess = !frame->postProcess;
+          } else if (event.key.keysym.sym == SDLK_o) {
+            frame->ambientOcclusion = !frame->ambientOcclusion;
+          } else if (event.key.keysym.sym == SDLK_g) {
+            frame->deferred = !frame->deferred;
+          } else if (event.key.keysym.sym == SDLK_r) {
+            frame->rayTrace = !frame->rayTrace;
+          } else if (event.key.keysym.sym == SDLK_h) {
+            frame->hdr = !frame->hdr;
+          }
+          break;
+        case SDL_MOUSEBUTTONDOWN:
+          if (resources->sceneState == ASSET_READY)
+            Pick(screen, resources, event.button.x, event.button.y);
+          break;
+      }
+    }
+    if (resources->sceneState == ASSET_FAILED)
+      running = false;
+
+    void* texturePixels;
+    int pitch;
+    SDL_LockTexture(texture, 0, &texturePixels, &pitch);
+    Render(screen, resources, frame);
+
+    renderTarget output = {(uint8_t*)texturePixels, screen->width,
+                           screen->height, (size_t)pitch, screen->output};
+    StoreTarget(screen->workers, screen->framebuffer, &output);
+    SDL_UnlockTexture(texture);
+    SDL_RenderCopyEx(renderer, texture, 0, 0, 0, 0, SDL_FLIP_VERTICAL);
+    SDL_RenderPresent(renderer);
+    ResetFrameArenas(screen->arenas);
+  }
+}
+
+// Header of the decoded texels LoadMaterial() caches next to a diffuse map,
+// 64 bytes so that the texels after it stay aligned when mapped.
+struct texelCache {
+  char magic[8];
+  int32_t x;
+  int32_t y;
+  int32_t normals;
+  int32_t specular;
+  int32_t transparent;
+  // Blocks follow instead of texels.
+  int32_t compressed;
+  // Newest modification time of the maps the texels were decoded from.
+  int64_t sourceTime;
+  char padding[24];
+};
+
+const char kTexelCacheMagic[8] = "TEXELS1";
+
+// Bytes of the tiled texels or blocks of an x by y material, a multiple of
+// 64.
+size_t TextureBytes(int32_t x, int32_t y, bool compressed) {
+  size_t tilesX = (x + kTexelTile - 1) / kTexelTile;
+  size_t tilesY = (y + kTexelTile - 1) / kTexelTile;
+  size_t bytes = tilesX * tilesY *
+                 (compressed ? sizeof(textureBlock)
+                             : kTexelTile * kTexelTile * sizeof(texel));
+  return (bytes + 63) / 64 * 64;
+}
+
+// Newest modification time among the maps that exist, 0 when none does.
+int64_t SourceTime(std::string const* paths, int32_t count) {
+  int64_t newest = 0;
+  for (int32_t i = 0; i < count; i++) {
+    struct stat info;
+    if (!paths[i].empty() && stat(paths[i].c_str(), &info) == 0)
+      newest = std::max<int64_t>(newest, info.st_mtime);
+  }
+  return newest;
+}
+
+// Maps the cached texels or blocks of a material when the cache is newer than
+// every map it was decoded from, nothing is decoded or copied.
+bool MapTexelCache(material* material,
+                   std::string const& path,
+                   int64_t sourceTime,
+                   bool compressed) {
+#if defined(_WIN32)
+  return false;
+#else
+  int file = open(path.c_str(), O_RDONLY);
+  if (file < 0)
+    return false;
+  struct stat info;
+  void* mapping = MAP_FAILED;
+  if (fstat(file, &info) == 0 && (size_t)info.st_size > sizeof(texelCache))
+    mapping = mmap(0, info.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (mapping == MAP_FAILED)
+    return false;
+
+  texelCache const* header = (texelCache const*)mapping;
+  if (memcmp(header->magic, kTexelCacheMagic, sizeof(header->magic)) != 0 ||
+      header->sourceTime != sourceTime || header->compressed != compressed ||
+      (size_t)info.st_size !=
+          sizeof(texelCache) +
+              TextureBytes(header->x, header->y, compressed)) {
+    munmap(mapping, info.st_size);
+    return false;
+  }
+  material->x = header->x;
+  material->y = header->y;
+  material->normals = (normalSpace)header->normals;
+  material->specular = header->specular;
+  material->transparent = header->transparent || material->opacity < 1.f;
+  material->texels = compressed ? 0 : (texel*)(header + 1);
+  material->blocks = compressed ? (textureBlock*)(header + 1) : 0;
+  material->mapped = info.st_size;
+  return true;
+#endif
+}
+
+// Written under a name of this thread's own and renamed, so that no other
+// loader ever maps a partial file.
+std::string TemporaryPath(std::string const& path) {
+  return path + "." +
+         std::to_string(
+             std::hash<std::thread::id>()(std::this_thread::get_id()));
+}
+
+// Best effort, a failed write only means the next run decodes again.
+void WriteTexelCache(material const* material,
+                     std::string const& path,
+                     int64_t sourceTime,
+                     bool transparent) {
+  texelCache header = {};
+  memcpy(header.magic, kTexelCacheMagic, sizeof(header.magic));
+  header.x = material->x;
+  header.y = material->y;
+  header.normals = material->normals;
+  header.specular = material->specular;
+  header.transparent = transparent;
+  header.compressed = material->blocks != 0;
+  header.sourceTime = sourceTime;
+  std::string temporary = TemporaryPath(path);
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if (!file)
+    return;
+  void const* payload =
+      material->blocks ? (void const*)material->blocks : material->texels;
+  bool written =
+      fwrite(&header, sizeof(header), 1, file) == 1 &&
+      fwrite(payload,
+             TextureBytes(material->x, material->y, header.compressed), 1,
+             file) == 1;
+  written &= fclose(file) == 0;
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    remove(temporary.c_str());
+}
+
+// Unmaps or frees the texels, blocks or pages of a material.
+void FreeTexels(material* material) {
+  if (pageTable* table = material->pages) {
+    fclose(table->file);
+    free(table->tail);
+    delete[] table->slots;
+    delete[] table->touched;
+    delete table;
+    return;
+  }
+#if !defined(_WIN32)
+  if (material->mapped) {
+    void* payload =
+        material->blocks ? (void*)material->blocks : material->texels;
+    munmap((texelCache*)payload - 1, material->mapped);
+    return;
+  }
+#endif
+  free(material->texels);
+  free(material->blocks);
+}
+
+// Reads a page of a streamed material from its page file.
+bool ReadPage(pageTable const* table, int32_t page, texel* texels) {
+  size_t bytes = (size_t)kPageTexels * kPageTexels * sizeof(texel);
+  return fseek(table->file, sizeof(texelCache) + page * bytes, SEEK_SET) ==
+             0 &&
+         fread(texels, bytes, 1, table->file) == 1;
+}
+
+// Body of pageCache::streamer. Reads the requests UpdatePages() hands over
+// and publishes every page as soon as it is read.
+void StreamPages(pageCache* cache) {
+  std::unique_lock<std::mutex> lock(cache->lock);
+  while (true) {
+    cache->wake.wait(lock, [cache] {
+      return cache->streaming || cache->stopping;
+    });
+    if (cache->stopping)
+      return;
+    lock.unlock();
+    for (int32_t i = 0; i < cache->requestCount; i++) {
+      pageRequest const* r = &cache->requests[i];
+      texel* texels =
+          &cache->texels[(size_t)r->slot * kPageTexels * kPageTexels];
+      // A page that cannot be read is requested again next frame.
+      r->table->slots[r->page] =
+          ReadPage(r->table, r->page, texels) ? r->slot : -1;
+    }
+    lock.lock();
+    cache->streaming = false;
+  }
+}
+
+void StopStreamer(pageCache* cache) {
+  {
+    std::lock_guard<std::mutex> lock(cache->lock);
+    cache->stopping = true;
+  }
+  cache->wake.notify_one();
+  cache->streamer.join();
+}
+
+// Runs between frames. Requests the pages the last frame sampled that are not
+// resident, coarsest first, evicting the least recently sampled pages for
+// them, and hands them to the streamer.
+void UpdatePages(resources* resources) {
+  pageCache* cache = resources->pages;
+  uint32_t frame = cache->frame++;
+  if (cache->streaming)
+    return;
+
+  int32_t count = 0;
+  auto collect = [&](material const* material) {
+    // The loader sets pages before publishing the state.
+    if (material->state != ASSET_READY || !material->pages)
+      return;
+    pageTable* table = material->pages;
+    for (int32_t level = table->levels - 2; level >= 0; level--) {
+      int32_t end = table->first[level + 1];
+      for (int32_t page = table->first[level]; page < end; page++) {
+        if (table->touched[page] == frame && table->slots[page] == -1 &&
+            count < kPageInsPerFrame)
+          cache->requests[count++] = {table, page, -1};
+      }
+    }
+  };
+  collect(resources->fallback);
+  if (resources->sceneState == ASSET_READY) {
+    for (int32_t i = 0; i < resources->materialCount; i++)
+      collect(&resources->materials[i]);
+  }
+
+  // Only the slots handed out here are loading, the others whose page does
+  // not point back at them are free.
+  for (int32_t i = 0; i < count; i++) {
+    pageRequest* request = &cache->requests[i];
+    int32_t victim = -1;
+    uint32_t oldest = 0;
+    for (int32_t slot = 0; slot < kResidentPages; slot++) {
+      pageTable const* owner = cache->owner[slot];
+      int32_t page = cache->page[slot];
+      if (owner && owner->slots[page] == kPageLoading)
+        continue;
+      if (!owner || owner->slots[page] != slot) {
+        victim = slot;
+        break;
+      }
+      uint32_t age = frame - owner->touched[page];
+      if (age > oldest) {
+        victim = slot;
+        oldest = age;
+      }
+    }
+    // Everything resident was sampled by the last frame, the rest wait.
+    if (victim < 0) {
+      count = i;
+      break;
+    }
+    pageTable* owner = cache->owner[victim];
+    if (owner && owner->slots[cache->page[victim]] == victim)
+      owner->slots[cache->page[victim]] = -1;
+    cache->owner[victim] = request->table;
+    cache->page[victim] = request->page;
+    request->table->slots[request->page] = kPageLoading;
+    request->slot = victim;
+  }
+  if (count == 0)
+    return;
+
+  cache->requestCount = count;
+  {
+    std::lock_guard<std::mutex> lock(cache->lock);
+    cache->streaming = true;
+  }
+  cache->wake.notify_one();
+}
+
+const char kPageFileMagic[8] = "PAGES01";
+
+// Sizes and first pages of the levels of a streamed x by y material.
+void SetPageLevels(pageTable* table, int32_t x, int32_t y) {
+  table->count = 0;
+  for (int32_t level = 0;; level++) {
+    table->x[level] = x;
+    table->y[level] = y;
+    table->pagesX[level] = (x + kPageTexels - 1) / kPageTexels;
+    table->first[level] = table->count;
+    table->count +=
+        table->pagesX[level] * ((y + kPageTexels - 1) / kPageTexels);
+    table->levels = level + 1;
+    if (x <= kPageTexels && y <= kPageTexels)
+      break;
+    x = std::max(1, x / 2);
+    y = std::max(1, y / 2);
+  }
+}
+
+// Writes the decoded texels of a material as pages of every level, each level
+// a box filtered half of the previous one. Best effort like
+// WriteTexelCache().
+bool WritePageFile(material const* material,
+                   std::string const& path,
+                   int64_t sourceTime,
+                   bool transparent) {
+  texelCache header = {};
+  memcpy(header.magic, kPageFileMagic, sizeof(header.magic));
+  header.x = material->x;
+  header.y = material->y;
+  header.normals = material->normals;
+  header.specular = material->specular;
+  header.transparent = transparent;
+  header.sourceTime = sourceTime;
+  std::string temporary = TemporaryPath(path);
+  FILE* file = fopen(temporary.c_str(), "wb");
+  if (!file)
+    return false;
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  pageTable table;
+  SetPageLevels(&table, material->x, material->y);
+  std::vector<texel> level(material->x * material->y);
+  for (int32_t y = 0; y < material->y; y++) {
+    for (int32_t x = 0; x < material->x; x++)
+      level[x + y * material->x] =
+          material->texels[TexelIndex(x, y, material->x)];
+  }
+  std::vector<texel> page(kPageTexels * kPageTexels);
+  for (int32_t l = 0; l < table.levels && written; l++) {
+    int32_t x = table.x[l];
+    int32_t y = table.y[l];
+    if (l > 0) {
+      // Every byte of a texel averaged over 2 x 2 texels of the level above,
+      // the last row and column of odd sizes repeat.
+      int32_t aboveX = table.x[l - 1];
+      int32_t aboveY = table.y[l - 1];
+      std::vector<texel> half(x * y);
+      for (int32_t j = 0; j < y; j++) {
+        for (int32_t i = 0; i < x; i++) {
+          int32_t x0 = std::min(2 * i, aboveX - 1);
+          int32_t x1 = std::min(2 * i + 1, aboveX - 1);
+          int32_t y0 = std::min(2 * j, aboveY - 1) * aboveX;
+          int32_t y1 = std::min(2 * j + 1, aboveY - 1) * aboveX;
+          uint8_t const* quad[4] = {
+              (uint8_t const*)&level[x0 + y0], (uint8_t const*)&level[x1 + y0],
+              (uint8_t const*)&level[x0 + y1], (uint8_t const*)&level[x1 + y1]};
+          uint8_t* out = (uint8_t*)&half[i + j * x];
+          for (size_t b = 0; b < sizeof(texel); b++) {
+            int32_t sum = quad[0][b] + quad[1][b] + quad[2][b] + quad[3][b];
+            out[b] = (sum + 2) / 4;
+          }
+        }
+      }
+      level.swap(half);
+    }
+    int32_t pagesY = (y + kPageTexels - 1) / kPageTexels;
+    for (int32_t p = 0; p < table.pagesX[l] * pagesY && written; p++) {
+      int32_t px = p % table.pagesX[l] * kPageTexels;
+      int32_t py = p / table.pagesX[l] * kPageTexels;
+      for (int32_t j = 0; j < kPageTexels; j++) {
+        for (int32_t i = 0; i < kPageTexels; i++)
+          page[TexelIndex(i, j, kPageTexels)] =
+              level[std::min(px + i, x - 1) + std::min(py + j, y - 1) * x];
+      }
+      written = fwrite(page.data(), page.size() * sizeof(texel), 1, file) == 1;
+    }
+  }
+  written &= fclose(file) == 0;
+  if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+    remove(temporary.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Opens the page file of a material when it is newer than every map it was
+// decoded from, and reads only its last level.
+bool OpenPageFile(material* material,
+                  std::string const& path,
+                  int64_t sourceTime,
+                  pageCache* cache) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+    return false;
+  texelCache header;
+  pageTable* table = new pageTable();
+  bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+               memcmp(header.magic, kPageFileMagic, sizeof(header.magic)) ==
+                   0 &&
+               header.sourceTime == sourceTime && header.x > 0 && header.y > 0;
+  if (valid) {
+    SetPageLevels(table, header.x, header.y);
+    valid = fseek(file, 0, SEEK_END) == 0 &&
+            ftell(file) == (long)(sizeof(texelCache) +
+                                  (size_t)table->count * kPageTexels *
+                                      kPageTexels * sizeof(texel));
+  }
+  table->file = file;
+  table->tail = (texel*)aligned_alloc(
+      64, kPageTexels * kPageTexels * sizeof(texel));
+  if (!valid || !ReadPage(table, table->count - 1, table->tail)) {
+    fclose(file);
+    free(table->tail);
+    delete table;
+    return false;
+  }
+  table->slots = new std::atomic<int32_t>[table->count];
+  table->touched = new std::atomic<uint32_t>[table->count];
+  for (int32_t i = 0; i < table->count; i++) {
+    table->slots[i] = -1;
+    table->touched[i] = 0;
+  }
+  table->cache = cache;
+
+  material->x = header.x;
+  material->y = header.y;
+  material->normals = (normalSpace)header.normals;
+  material->specular = header.specular;
+  material->transparent = header.transparent || material->opacity < 1.f;
+  material->texels = 0;
+  material->blocks = 0;
+  material->mapped = 0;
+  material->pages = table;
+  return true;
+}
+
+// Decodes the diffuse, normal and specular maps of a material concurrently
+// and interleaves them into its texels, or compresses those into blocks, or
+// streams them from pages when a page cache is given. Only the diffuse map is
+// required, when its name ends in _diffuse.tga the others are looked up next
+// to it by suffix. Prints why when the diffuse map cannot be loaded.
+bool LoadMaterial(material* material,
+                  std::string const& diffusePath,
+                  bool compress,
+                  pageCache* pages) {
+  enum { DIFFUSE, NORMALS_TANGENT_MAP, NORMALS_OBJECT_MAP, SPECULAR, MAPS };
+  char const* suffixes[MAPS] = {"_diffuse.tga", "_nm_tangent.tga", "_nm.tga",
+                                "_spec.tga"};
+  int32_t channels[MAPS] = {4, 3, 3, 1};
+
+  std::string paths[MAPS] = {diffusePath};
+  size_t stem = diffusePath.size() - strlen(suffixes[DIFFUSE]);
+  if (diffusePath.size() > strlen(suffixes[DIFFUSE]) &&
+      diffusePath.compare(stem, std::string::npos, suffixes[DIFFUSE]) == 0) {
+    for (int32_t i = 1; i < MAPS; i++)
+      paths[i] = diffusePath.substr(0, stem) + suffixes[i];
+  }
+  material->shininess = 32.f;
+  // Pages are kept uncompressed, a decoded block could outlive its page.
+  compress &= !pages;
+  std::string cachePath = diffusePath + (compress ? ".blocks" : ".texels");
+  std::string pagePath = diffusePath + ".pages";
+  int64_t sourceTime = SourceTime(paths, MAPS);
+  if (pages ? OpenPageFile(material, pagePath, sourceTime, pages)
+            : MapTexelCache(material, cachePath, sourceTime, compress))
+    return true;
+
+  image images[MAPS] = {};
+  std::thread loaders[MAPS];
+  for (int32_t i = 0; i < MAPS; i++) {
+    loaders[i] = std::thread([&, i] {
+      int fileChannels;
+      images[i].channels = channels[i];
+      if (paths[i].empty())
+        return;
+      // stb_image keeps one failure reason for all threads, so missing maps,
+      // the common case for the optional ones, never reach it.
+      FILE* file = fopen(paths[i].c_str(), "rb");
+      if (!file) {
+        images[i].failure = "can't fopen";
+        return;
+      }
+      images[i].buffer = stbi_load_from_file(file, &images[i].x, &images[i].y,
+                                             &fileChannels, channels[i]);
+      if (!images[i].buffer)
+        images[i].failure = stbi_failure_reason();
+      fclose(file);
+    });
+  }
+  for (int32_t i = 0; i < MAPS; i++)
+    loaders[i].join();
+
+  image const* diffuse = &images[DIFFUSE];
+  if (!diffuse->buffer) {
+    std::cout << diffusePath << ": " << diffuse->failure << std::endl;
+    for (int32_t i = 0; i < MAPS; i++)
+      stbi_image_free((void*)images[i].buffer);
+    return false;
+  }
+  image const* normals = images[NORMALS_TANGENT_MAP].buffer
+                             ? &images[NORMALS_TANGENT_MAP]
+                             : &images[NORMALS_OBJECT_MAP];
+  image const* specular = &images[SPECULAR];
+
+  material->x = diffuse->x;
+  material->y = diffuse->y;
+  material->normals = images[NORMALS_TANGENT_MAP].buffer ? NORMALS_TANGENT
+                      : images[NORMALS_OBJECT_MAP].buffer ? NORMALS_OBJECT
+                                                          : NORMALS_NONE;
+  material->specular = specular->buffer;
+  bool transparent = false;
+  material->texels = (texel*)aligned_alloc(
+      64, TextureBytes(material->x, material->y, false));
+  material->blocks = 0;
+  material->mapped = 0;
+  material->pages = 0;
+
+  // Maps with a different size than the diffuse one are resampled to it.
+  auto fetch = [&](image const* map, int32_t x, int32_t y) {
+    int32_t mapx = x * map->x / material->x;
+    int32_t mapy = y * map->y / material->y;
+    return &map->buffer[map->channels * (mapx + mapy * map->x)];
+  };
+  // Written tile by tile in storage order, texels past the edge of the maps
+  // repeat their last row and column.
+  int32_t tilesX = (material->x + kTexelTile - 1) / kTexelTile;
+  int32_t tilesY = (material->y + kTexelTile - 1) / kTexelTile;
+  texel* t = material->texels;
+  for (int32_t tile = 0; tile < tilesX * tilesY; tile++) {
+    for (int32_t i = 0; i < kTexelTile * kTexelTile; i++, t++) {
+      int32_t x = std::min(tile % tilesX * kTexelTile + i % kTexelTile,
+                           material->x - 1);
+      int32_t y = std::min(tile / tilesX * kTexelTile + i / kTexelTile,
+                           material->y - 1);
+      uint8_t const* color = fetch(diffuse, x, y);
+      t->red = color[0];
+      t->green = color[1];
+      t->blue = color[2];
+      t->alpha = color[3];
+      transparent |= t->alpha < 255;
+      t->normalX = t->normalY = 128;
+      t->normalZ = 255;
+      if (normals->buffer) {
+        uint8_t const* normal = fetch(normals, x, y);
+        t->normalX = normal[0];
+        t->normalY = normal[1];
+        t->normalZ = normal[2];
+      }
+      t->specular = specular->buffer ? *fetch(specular, x, y) : 0;
+    }
+  }
+
+  for (int32_t i = 0; i < MAPS; i++)
+    stbi_image_free((void*)images[i].buffer);
+  material->transparent = transparent || material->opacity < 1.f;
+
+  // Stays resident when the pages cannot be written.
+  texel* texels = material->texels;
+  if (pages && WritePageFile(material, pagePath, sourceTime, transparent) &&
+      OpenPageFile(material, pagePath, sourceTime, pages)) {
+    free(texels);
+    return true;
+  }
+  if (compress) {
+    textureBlock* blocks = (textureBlock*)aligned_alloc(
+        64, TextureBytes(material->x, material->y, true));
+    for (int32_t tile = 0; tile < tilesX * tilesY; tile++)
+      EncodeBlock(&material->texels[tile * kTexelTile * kTexelTile],
+                  &blocks[tile]);
+    free(material->texels);
+    material->texels = 0;
+    material->blocks = blocks;
+  }
+  WriteTexelCache(material, cachePath, sourceTime, transparent);
+  return true;
+}
+
+// Vertices kept by the FIFO cache that face order is optimized and measured
+// for.
+const int32_t kVertexCacheSize = 16;
+
+// Faces after which a cluster ends at the next fan, so clusters stay small
+// enough to sort for overdraw.
+const size_t kClusterFaces = 128;
+
+// Average cache misses per triangle, 3 with no reuse and 0.5 at best for large
+// regular meshes.
+float AverageCacheMissRatio(std::vector<uint32_t> const& indices,
+                            size_t vertexCount) {
+  if (indices.empty())
+    return 0;
+  // A vertex is cached while fewer than kVertexCacheSize misses happened
+  // since it was last loaded.
+  std::vector<int64_t> loaded(vertexCount, -kVertexCacheSize - 1);
+  int64_t misses = 0;
+  for (uint32_t index : indices) {
+    if (misses - loaded[index] > kVertexCacheSize) {
+      loaded[index] = misses;
+      misses++;
+    }
+  }
+  return (float)misses / (indices.size() / 3);
+}
+
+// Faces around every vertex v of a triangle list, faces[offsets[v]] up to
+// faces[offsets[v + 1]].
+void FaceAdjacency(std::vector<uint32_t> const& indices,
+                   size_t vertexCount,
+                   std::vector<uint32_t>* offsets,
+                   std::vector<uint32_t>* faces) {
+  offsets->assign(vertexCount + 1, 0);
+  for (uint32_t index : indices)
+    (*offsets)[index + 1]++;
+  for (size_t v = 0; v < vertexCount; v++)
+    (*offsets)[v + 1] += (*offsets)[v];
+  faces->resize(indices.size());
+  std::vector<uint32_t> filled(offsets->begin(), offsets->end() - 1);
+  for (size_t i = 0; i < indices.size(); i++)
+    (*faces)[filled[indices[i]]++] = i / 3;
+}
+
+// Reorders the faces of a mesh for vertex reuse and less overdraw, after
+// Tipsify by Sander et al. Triangles are emitted in fans around vertices that
+// are still cached, and a new cluster begins whenever the next fan starts on
+// an evicted vertex or the current cluster is full. Clusters are then sorted
+// so that the ones facing away from the mesh center, which tend to occlude
+// the rest, are drawn first.
+void OptimizeFaceOrder(std::vector<vec3> const& positions,
+                       std::vector<uint32_t>* triangles) {
+  std::vector<uint32_t> const& indices = *triangles;
+  size_t faceCount = indices.size() / 3;
+  size_t vertexCount = positions.size();
+  if (faceCount == 0)
+    return;
+
+  // Faces around every vertex, and how many of them are left to emit.
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> adjacency;
+  FaceAdjacency(indices, vertexCount, &offsets, &adjacency);
+  std::vector<uint32_t> live(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++)
+    live[v] = offsets[v + 1] - offsets[v];
+
+  std::vector<int64_t> loaded(vertexCount, -kVertexCacheSize - 1);
+  std::vector<bool> emitted(faceCount, false);
+  std::vector<uint32_t> deadEnds;
+  std::vector<uint32_t> candidates;
+  std::vector<uint32_t> order;
+  std::vector<size_t> clusters;
+  int64_t time = 0;
+  size_t cursor = 0;
+  int64_t fan = 0;
+  while (fan >= 0) {
+    if (clusters.empty() || time - loaded[fan] > kVertexCacheSize ||
+        order.size() - clusters.back() >= kClusterFaces)
+      clusters.push_back(order.size());
+
+    candidates.clear();
+    for (uint32_t k = offsets[fan]; k < offsets[fan + 1]; k++) {
+      uint32_t face = adjacency[k];
+      if (emitted[face])
+        continue;
+      emitted[face] = true;
+      order.push_back(face);
+      for (int32_t j = 0; j < 3; j++) {
+        uint32_t v = indices[3 * face + j];
+        deadEnds.push_back(v);
+        candidates.push_back(v);
+        live[v]--;
+        if (time - loaded[v] > kVertexCacheSize)
+          loaded[v] = time++;
+      }
+    }
+
+    // Prefer the candidate that stays cached through its remaining fan and
+    // was loaded longest ago, then fall back to recent dead ends and finally
+    // to the first vertex in index order with faces left.
+    fan = -1;
+    int64_t best = -1;
+    for (uint32_t v : candidates) {
+      if (live[v] == 0)
+        continue;
+      int64_t priority = 0;
+      if (time - loaded[v] + 2 * live[v] <= kVertexCacheSize)
+        priority = time - loaded[v];
+      if (priority > best) {
+        best = priority;
+        fan = v;
+      }
+    }
+    while (fan < 0 && !deadEnds.empty()) {
+      uint32_t v = deadEnds.back();
+      deadEnds.pop_back();
+      if (live[v] > 0)
+        fan = v;
+    }
+    while (fan < 0 && cursor < vertexCount) {
+      if (live[cursor] > 0)
+        fan = cursor;
+      cursor++;
+    }
+  }
+
+  // Occlusion potential of every cluster, the distance of its center in
+  // front of the mesh center along its average normal.
+  vec3 center(0);
+  for (vec3 const& position : positions)
+    center += position;
+  center /= (float)vertexCount;
+  clusters.push_back(order.size());
+  std::vector<std::pair<float, size_t>> potentials;
+  vec3 const* p = positions.data();
+  for (size_t c = 0; c + 1 < clusters.size(); c++) {
+    vec3 clusterCenter(0);
+    vec3 normal(0);
+    for (size_t k = clusters[c]; k < clusters[c + 1]; k++) {
+      uint32_t const* face = &indices[3 * order[k]];
+      clusterCenter += p[face[0]] + p[face[1]] + p[face[2]];
+      // Area weighted.
+      normal += glm::cross(p[face[1]] - p[face[0]], p[face[2]] - p[face[0]]);
+    }
+    clusterCenter /= 3.f * (clusters[c + 1] - clusters[c]);
+    float length = glm::length(normal);
+    float potential =
+        length > 0 ? glm::dot(clusterCenter - center, normal / length) : 0;
+    potentials.push_back({-potential, c});
+  }
+  std::stable_sort(potentials.begin(), potentials.end());
+
+  std::vector<uint32_t> sorted;
+  sorted.reserve(indices.size());
+  for (auto const& potential : potentials) {
+    size_t c = potential.second;
+    for (size_t k = clusters[c]; k < clusters[c + 1]; k++)
+      sorted.insert(sorted.end(), &indices[3 * order[k]],
+                    &indices[3 * order[k]] + 3);
+  }
+  triangles->swap(sorted);
+}
+
+const uint32_t kMeshletVertices = 64;
+const uint32_t kMeshletFaces = 124;
+
+// Groups the faces of a triangle list into meshlets of at most
+// kMeshletVertices vertices and kMeshletFaces faces and reorders the faces
+// meshlet by meshlet. A meshlet starts at the first face left in the current
+// order and grows through faces sharing its vertices, preferring faces that
+// add few vertices and whose normal is close to the meshlet's average, so
+// the normal cones stay narrow enough to cull.
+void BuildMeshlets(std::vector<vec3> const& positions,
+                   std::vector<uint32_t>* triangles,
+                   std::vector<meshlet>* meshlets) {
+  std::vector<uint32_t> const& indices = *triangles;
+  uint32_t faceCount = indices.size() / 3;
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> adjacency;
+  FaceAdjacency(indices, positions.size(), &offsets, &adjacency);
+
+  // Faces without area have no normal, they never cull.
+  std::vector<vec3> normals(faceCount);
+  for (uint32_t i = 0; i < faceCount; i++) {
+    vec3 const* p[3];
+    for (int32_t j = 0; j < 3; j++)
+      p[j] = &positions[indices[3 * i + j]];
+    vec3 normal = glm::cross(*p[1] - *p[0], *p[2] - *p[0]);
+    if (glm::length(normal) > 0)
+      normals[i] = glm::normalize(normal);
+  }
+
+  std::vector<bool> emitted(faceCount, false);
+  std::vector<uint32_t> seen(positions.size(), UINT32_MAX);
+  std::vector<uint32_t> vertices;
+  std::vector<uint32_t> order;
+  uint32_t cursor = 0;
+  while (order.size() < faceCount) {
+    meshlet meshlet = {};
+    meshlet.firstFace = order.size();
+    uint32_t id = meshlets->size();
+    vertices.clear();
+    vec3 sum(0);
+
+    while (cursor < faceCount && emitted[cursor])
+      cursor++;
+    int64_t face = cursor;
+    while (face >= 0) {
+      emitted[face] = true;
+      order.push_back(face);
+      sum += normals[face];
+      for (int32_t j = 0; j < 3; j++) {
+        uint32_t index = indices[3 * face + j];
+        if (seen[index] != id) {
+          seen[index] = id;
+          vertices.push_back(index);
+        }
+      }
+      if (order.size() - meshlet.firstFace == kMeshletFaces)
+        break;
+
+      vec3 axis = glm::length(sum) > 0 ? glm::normalize(sum) : vec3(0);
+      face = -1;
+      float best = 0;
+      for (uint32_t index : vertices) {
+        for (uint32_t k = offsets[index]; k < offsets[index + 1]; k++) {
+          uint32_t candidate = adjacency[k];
+          if (emitted[candidate])
+            continue;
+          uint32_t added = 0;
+          for (int32_t j = 0; j < 3; j++)
+            added += seen[indices[3 * candidate + j]] != id;
+          if (vertices.size() + added > kMeshletVertices)
+            continue;
+          float score = added + 1 - glm::dot(normals[candidate], axis);
+          if (face < 0 || score < best) {
+            best = score;
+            face = candidate;
+          }
+        }
+      }
+    }
+    meshlet.faceCount = order.size() - meshlet.firstFace;
+
+    vec3 low = positions[vertices[0]];
+    vec3 high = low;
+    for (uint32_t index : vertices) {
+      low = glm::min(low, positions[index]);
+      high = glm::max(high, positions[index]);
+    }
+    meshlet.center = (low + high) / 2.f;
+    for (uint32_t index : vertices)
+      meshlet.radius = std::max(
+          meshlet.radius, glm::length(positions[index] - meshlet.center));
+
+    // The cone axis is the average normal and its half angle the widest
+    // normal around it. With a half angle a every face points away when the
+    // angle between the axis and the view exceeds 90 + a degrees, that is
+    // when axis.z < -sin(a).
+    meshlet.axis = glm::length(sum) > 0 ? glm::normalize(sum) : vec3(0);
+    float spread = 1;
+    for (uint32_t i = meshlet.firstFace; i < order.size(); i++) {
+      if (normals[order[i]] != vec3(0))
+        spread = std::min(spread, glm::dot(normals[order[i]], meshlet.axis));
+    }
+    meshlet.cutoff = spread > 0 ? -std::sqrt(1 - spread * spread) : -1.f;
+    meshlets->push_back(meshlet);
+  }
+
+  std::vector<uint32_t> sorted;
+  sorted.reserve(indices.size());
+  for (uint32_t face : order)
+    sorted.insert(sorted.end(), &indices[3 * face], &indices[3 * face] + 3);
+  triangles->swap(sorted);
+}
+
+// Sum of squared distances to a set of weighted planes, as a symmetric 4x4
+// matrix.
+struct quadric {
+  double a2, ab, ac, ad, b2, bc, bd, c2, cd, d2;
+  double weight;
+};
+
+void AddPlane(quadric* q, vec3 normal, float distance, double weight) {
+  double a = normal.x;
+  double b = normal.y;
+  double c = normal.z;
+  double d = distance;
+  q->a2 += weight * a * a;
+  q->ab += weight * a * b;
+  q->ac += weight * a * c;
+  q->ad += weight * a * d;
+  q->b2 += weight * b * b;
+  q->bc += weight * b * c;
+  q->bd += weight * b * d;
+  q->c2 += weight * c * c;
+  q->cd += weight * c * d;
+  q->d2 += weight * d * d;
+  q->weight += weight;
+}
+
+void AddQuadric(quadric* q, quadric const* other) {
+  q->a2 += other->a2;
+  q->ab += other->ab;
+  q->ac += other->ac;
+  q->ad += other->ad;
+  q->b2 += other->b2;
+  q->bc += other->bc;
+  q->bd += other->bd;
+  q->c2 += other->c2;
+  q->cd += other->cd;
+  q->d2 += other->d2;
+  q->weight += other->weight;
+}
+
+// Weighted mean squared distance of p to the planes of both quadrics.
+double QuadricError(quadric const* q, quadric const* r, vec3 p) {
+  double x = p.x;
+  double y = p.y;
+  double z = p.z;
+  double a2 = q->a2 + r->a2;
+  double b2 = q->b2 + r->b2;
+  double c2 = q->c2 + r->c2;
+  double error = a2 * x * x + b2 * y * y + c2 * z * z + q->d2 + r->d2 +
+                 2 * ((q->ab + r->ab) * x * y + (q->ac + r->ac) * x * z +
+                      (q->bc + r->bc) * y * z + (q->ad + r->ad) * x +
+                      (q->bd + r->bd) * y + (q->cd + r->cd) * z);
+  double weight = q->weight + r->weight;
+  return weight > 0 ? std::max(error, 0.0) / weight : 0;
+}
+
+// Simplifies a triangle list towards targetFaces faces by collapsing edges
+// onto one of their vertices, cheapest first by quadric error metrics
+// (Garland and Heckbert), so the result uses only existing vertices and
+// keeps their attributes. Vertices on open or seam edges never move, and
+// collapses that would flip a face are skipped. Each pass sorts the
+// candidate collapses and applies those whose neighbourhood is untouched
+// so far in the pass. The largest distance of a removed vertex to the
+// planes of the faces around the vertex it collapsed into is added to
+// error.
+std::vector<uint32_t> Simplify(std::vector<vec3> const& positions,
+                               std::vector<uint32_t> const& source,
+                               size_t targetFaces,
+                               float* error) {
+  size_t vertexCount = positions.size();
+  std::vector<uint32_t> indices = source;
+
+  std::vector<quadric> quadrics(vertexCount, quadric{});
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    vec3 p0 = positions[indices[i]];
+    vec3 normal = glm::cross(positions[indices[i + 1]] - p0,
+                             positions[indices[i + 2]] - p0);
+    float area = glm::length(normal);
+    if (area == 0)
+      continue;
+    normal /= area;
+    for (int32_t j = 0; j < 3; j++)
+      AddPlane(&quadrics[indices[i + j]], normal, -glm::dot(normal, p0), area);
+  }
+
+  // Edges used by a single face, in either direction.
+  std::vector<uint64_t> edges;
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    for (int32_t j = 0; j < 3; j++) {
+      uint64_t a = indices[i + j];
+      uint64_t b = indices[i + (j + 1) % 3];
+      edges.push_back(std::min(a, b) << 32 | std::max(a, b));
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  std::vector<bool> locked(vertexCount, false);
+  for (size_t i = 0; i < edges.size(); i++) {
+    bool shared = (i > 0 && edges[i - 1] == edges[i]) ||
+                  (i + 1 < edges.size() && edges[i + 1] == edges[i]);
+    if (!shared) {
+      locked[edges[i] >> 32] = true;
+      locked[edges[i] & 0xFFFFFFFF] = true;
+    }
+  }
+
+  struct collapse {
+    double cost;
+    uint32_t from;
+    uint32_t to;
+    bool operator<(collapse const& other) const { return cost < other.cost; }
+  };
+  std::vector<collapse> collapses;
+  std::vector<uint32_t> offsets;
+  std::vector<uint32_t> adjacency;
+  std::vector<bool> touched;
+  std::vector<uint32_t> remap(vertexCount);
+  for (size_t v = 0; v < vertexCount; v++)
+    remap[v] = v;
+  while (indices.size() / 3 > targetFaces) {
+    FaceAdjacency(indices, vertexCount, &offsets, &adjacency);
+    collapses.clear();
+    for (size_t i = 0; i < indices.size(); i += 3) {
+      for (int32_t j = 0; j < 3; j++) {
+        uint32_t a = indices[i + j];
+        uint32_t b = indices[i + (j + 1) % 3];
+        double cost =
+            QuadricError(&quadrics[a], &quadrics[b], positions[b]);
+        if (!locked[a])
+          collapses.push_back({cost, a, b});
+        cost = QuadricError(&quadrics[a], &quadrics[b], positions[a]);
+        if (!locked[b])
+          collapses.push_back({cost, b, a});
+      }
+    }
+    std::sort(collapses.begin(), collapses.end());
+
+    touched.assign(vertexCount, false);
+    size_t faces = indices.size() / 3;
+    size_t applied = 0;
+    for (collapse const& c : collapses) {
+      if (faces <= targetFaces)
+        break;
+      if (touched[c.from] || touched[c.to])
+        continue;
+
+      // Faces around from either vanish, when they also use to, or move
+      // their corner to it and must keep facing the same side.
+      size_t removed = 0;
+      bool flips = false;
+      for (uint32_t k = offsets[c.from]; k < offsets[c.from + 1]; k++) {
+        uint32_t const* face = &indices[3 * adjacency[k]];
+        if (face[0] == c.to || face[1] == c.to || face[2] == c.to) {
+          removed++;
+          continue;
+        }
+        vec3 before[3];
+        vec3 after[3];
+        for (int32_t j = 0; j < 3; j++) {
+          before[j] = positions[face[j]];
+          after[j] = face[j] == c.from ? positions[c.to] : before[j];
+        }
+        vec3 oldNormal =
+            glm::cross(before[1] - before[0], before[2] - before[0]);
+        vec3 newNormal = glm::cross(after[1] - after[0], after[2] - after[0]);
+        flips |= glm::dot(oldNormal, newNormal) <= 0;
+      }
+      if (flips)
+        continue;
+
+      for (uint32_t k = offsets[c.from]; k < offsets[c.from + 1]; k++) {
+        uint32_t* face = &indices[3 * adjacency[k]];
+        for (int32_t j = 0; j < 3; j++) {
+          touched[face[j]] = true;
+          if (face[j] == c.from)
+            face[j] = c.to;
+        }
+      }
+      touched[c.to] = true;
+      AddQuadric(&quadrics[c.to], &quadrics[c.from]);
+      remap[c.from] = c.to;
+      faces -= removed;
+      applied++;
+    }
+    if (applied == 0)
+      break;
+
+    // Drop the faces that collapsed to a line.
+    size_t kept = 0;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+      uint32_t a = indices[i];
+      uint32_t b = indices[i + 1];
+      uint32_t c = indices[i + 2];
+      if (a == b || b == c || c == a)
+        continue;
+      indices[kept++] = a;
+      indices[kept++] = b;
+      indices[kept++] = c;
+    }
+    indices.resize(kept);
+  }
+
+  FaceAdjacency(indices, vertexCount, &offsets, &adjacency);
+  float largest = 0;
+  for (size_t v = 0; v < vertexCount; v++) {
+    if (remap[v] == v)
+      continue;
+    uint32_t kept = v;
+    while (remap[kept] != kept)
+      kept = remap[kept];
+    float nearest = FLT_MAX;
+    for (uint32_t k = offsets[kept]; k < offsets[kept + 1]; k++) {
+      uint32_t const* face = &indices[3 * adjacency[k]];
+      vec3 p0 = positions[face[0]];
+      vec3 normal =
+          glm::cross(positions[face[1]] - p0, positions[face[2]] - p0);
+      if (glm::length(normal) > 0)
+        nearest = std::min(nearest, std::abs(glm::dot(
+                                        glm::normalize(normal),
+                                        positions[v] - p0)));
+    }
+    if (nearest < FLT_MAX)
+      largest = std::max(largest, nearest);
+  }
+  *error += largest;
+  return indices;
+}
+
+// Levels of detail built per mesh, each with a quarter of the faces of the
+// one before.
+const int32_t kMaxLods = 4;
+
+// Appends the meshes of a node and its children with their accumulated
+// transforms applied.
+void FlattenNode(aiScene const* scene,
+                 aiNode const* node,
+                 mat4 parent,
+                 resources* resources) {
+  mat4 transform = parent * convertGlm(node->mTransformation);
+  glm::mat3 normalTransform =
+      glm::transpose(glm::inverse(glm::mat3(transform)));
+
+  for (uint32_t i = 0; i < node->mNumMeshes; i++) {
+    aiMesh const* source = scene->mMeshes[node->mMeshes[i]];
+    resources->meshes.emplace_back();
+    mesh* mesh = &resources->meshes.back();
+    mesh->material = &resources->materials[source->mMaterialIndex];
+
+    for (uint32_t j = 0; j < source->mNumVertices; j++) {
+      vec3 position = vec3(transform *
+                           vec4(convertGlm(source->mVertices[j]), 1.f));
+      mesh->positions.push_back(position);
+      resources->radius = std::max(resources->radius, glm::length(position));
+
+      vec3 normal = source->HasNormals() ? convertGlm(source->mNormals[j])
+                                         : vec3(0, 0, 1);
+      mesh->normals.push_back(glm::normalize(normalTransform * normal));
+      vec3 tangent(0);
+      vec3 bitangent(0);
+      if (source->HasTangentsAndBitangents()) {
+        tangent = glm::mat3(transform) * convertGlm(source->mTangents[j]);
+        bitangent = glm::mat3(transform) * convertGlm(source->mBitangents[j]);
+      }
+      mesh->tangents.push_back(tangent);
+      mesh->bitangents.push_back(bitangent);
+      vec2 uv(0);
+      if (source->HasTextureCoords(0))
+        uv = vec2(source->mTextureCoords[0][j].x,
+                  source->mTextureCoords[0][j].y);
+      mesh->uvs.push_back(uv);
+    }
+
+    // Points and lines are left out, only triangles are drawn.
+    std::vector<uint32_t> indices;
+    for (uint32_t j = 0; j < source->mNumFaces; j++) {
+      aiFace const& face = source->mFaces[j];
+      if (face.mNumIndices != 3)
+        continue;
+      indices.insert(indices.end(), face.mIndices, face.mIndices + 3);
+    }
+    float before = AverageCacheMissRatio(indices, source->mNumVertices);
+
+    // Every level is simplified from the one before and stops the chain when
+    // it cannot drop at least a quarter of its faces.
+    float error = 0;
+    for (int32_t level = 0; level < kMaxLods; level++) {
+      if (level > 0) {
+        size_t faces = indices.size() / 3;
+        indices = Simplify(mesh->positions, indices, faces / 4, &error);
+        if (indices.empty() || indices.size() / 3 > faces * 3 / 4)
+          break;
+      }
+      std::vector<uint32_t> lodIndices = indices;
+      std::vector<meshlet> meshlets;
+      OptimizeFaceOrder(mesh->positions, &lodIndices);
+      BuildMeshlets(mesh->positions, &lodIndices, &meshlets);
+
+      meshLod lod;
+      lod.firstFace = mesh->indices.size() / 3;
+      lod.faceCount = lodIndices.size() / 3;
+      lod.firstMeshlet = mesh->meshlets.size();
+      lod.meshletCount = meshlets.size();
+      lod.error = error;
+      std::vector<vec3> lows;
+      std::vector<vec3> highs;
+      for (meshlet& meshlet : meshlets) {
+        meshlet.firstFace += lod.firstFace;
+        mesh->meshlets.push_back(meshlet);
+        lows.push_back(meshlet.center - meshlet.radius);
+        highs.push_back(meshlet.center + meshlet.radius);
+      }
+      BuildBvh(lows, highs, 4, &lod.meshletBvh);
+      mesh->indices.insert(mesh->indices.end(), lodIndices.begin(),
+                           lodIndices.end());
+      mesh->lods.push_back(lod);
+    }
+
+    std::vector<uint32_t> full(
+        mesh->indices.begin(),
+        mesh->indices.begin() + 3 * mesh->lods[0].faceCount);
+    std::vector<vec3> lows;
+    std::vector<vec3> highs;
+    for (size_t j = 0; j < full.size(); j += 3) {
+      vec3 const* p = mesh->positions.data();
+      lows.push_back(
+          glm::min(glm::min(p[full[j]], p[full[j + 1]]), p[full[j + 2]]));
+      highs.push_back(
+          glm::max(glm::max(p[full[j]], p[full[j + 1]]), p[full[j + 2]]));
+    }
+    BuildBvh(lows, highs, 4, &mesh->faceBvh);
+    float after = AverageCacheMissRatio(full, source->mNumVertices);
+    std::cout << "mesh " << resources->meshes.size() - 1 << ": ACMR "
+              << before << " -> " << after << ", faces per LOD";
+    for (meshLod const& lod : mesh->lods)
+      std::cout << " " << lod.faceCount;
+    std::cout << std::endl;
+  }
+
+  for (uint32_t i = 0; i < node->mNumChildren; i++)
+    FlattenNode(scene, node->mChildren[i], transform, resources);
+}
+
+// Imports the scene and flattens it into the draw list, then loads the
+// textures of every material concurrently. The fallback material loads at the
+// same time as the import, the window opens while all of this happens and
+// Draw() skips whatever is not ready yet.
+void LoadResources(resources* resources,
+                   std::string const& modelPath,
+                   std::thread* sceneLoader,
+                   std::thread* fallbackLoader) {
+  resources->sceneState = ASSET_LOADING;
+  std::string stem = modelPath.substr(0, modelPath.rfind('.'));
+  std::string directory = modelPath.substr(0, modelPath.rfind('/') + 1);
+
+  *fallbackLoader = std::thread([resources, stem] {
+    material* fallback = resources->fallback;
+    fallback->state = ASSET_LOADING;
+    if (!LoadMaterial(fallback, stem + "_diffuse.tga",
+                      resources->compressTextures, resources->pages)) {
+      fallback->state = ASSET_FAILED;
+      return;
+    }
+    fallback->state = ASSET_READY;
+  });
+
+  *sceneLoader = std::thread([resources, modelPath, directory] {
+    aiScene const* scene =
+        aiImportFile(modelPath.c_str(), aiProcessPreset_TargetRealtime_Fast);
+    if (!scene) {
+      std::cout << aiGetErrorString();
+      resources->sceneState = ASSET_FAILED;
+      return;
+    }
+
+    // Materials without a diffuse texture share the fallback's texels once
+    // it is ready, so only the others decode anything.
+    resources->materialCount = scene->mNumMaterials;
+    resources->materials = new material[scene->mNumMaterials]();
+    std::vector<std::string> texturePaths(scene->mNumMaterials);
+    for (uint32_t i = 0; i < scene->mNumMaterials; i++) {
+      aiString path;
+      if (aiGetMaterialTexture(scene->mMaterials[i], aiTextureType_DIFFUSE, 0,
+                               &path) == aiReturn_SUCCESS)
+        texturePaths[i] = directory + path.C_Str();
+      float opacity = 1.f;
+      aiGetMaterialFloat(scene->mMaterials[i], AI_MATKEY_OPACITY, &opacity);
+      resources->materials[i].opacity = opacity;
+      resources->materials[i].state = ASSET_LOADING;
+    }
+
+    FlattenNode(scene, scene->mRootNode, mat4(1.f), resources);
+    for (mesh& mesh : resources->meshes) {
+      if (texturePaths[mesh.material - resources->materials].empty())
+        mesh.material = resources->fallback;
+    }
+    std::stable_sort(resources->meshes.begin(), resources->meshes.end(),
+                     [](mesh const& a, mesh const& b) {
+                       return a.material < b.material;
+                     });
+    std::vector<vec3> lows;
+    std::vector<vec3> highs;
+    for (mesh const& mesh : resources->meshes) {
+      vec3 low(FLT_MAX);
+      vec3 high(-FLT_MAX);
+      for (vec3 const& position : mesh.positions) {
+        low = glm::min(low, position);
+        high = glm::max(high, position);
+      }
+      lows.push_back(low);
+      highs.push_back(high);
+    }
+    BuildBvh(lows, highs, 1, &resources->meshBvh);
+    aiReleaseImport(scene);
+    resources->sceneState = ASSET_READY;
+
+    std::vector<std::thread> loaders;
+    for (int32_t i = 0; i < resources->materialCount; i++) {
+      if (texturePaths[i].empty())
+        continue;
+      loaders.emplace_back([resources, i, &texturePaths] {
+        material* material = &resources->materials[i];
+        if (!LoadMaterial(material, texturePaths[i],
+                          resources->compressTextures, resources->pages)) {
+          material->state = ASSET_FAILED;
+          return;
+        }
+        material->state = ASSET_READY;
+      });
+    }
+    for (std::thread& loader : loaders)
+      loader.join();
+  });
+}
+
+// Pass --bench [frames] to time the rasterizers offscreen instead of opening
+// a window, --compress anywhere to block compress textures, --stream to
+// stream them in pages and --format rgba8, bgra8 or rgb565 to pick the format
+// of the window texture.
+int main(int argc, char** argv) {
+  bool benchmark = argc > 1 && strcmp(argv[1], "--bench") == 0;
+  int32_t benchmarkFrames = 100;
+  // The count is optional, a flag may follow --bench directly.
+  if (benchmark && argc > 2 && strncmp(argv[2], "--", 2) != 0) {
+    char* end;
+    long frames = strtol(argv[2], &end, 10);
+    if (*end || frames <= 0 || frames > INT32_MAX) {
+      std::cout << "usage: " << argv[0] << " --bench [frames > 0]"
+                << std::endl;
+      return 1;
+    }
+    benchmarkFrames = frames;
+  }
+  bool compress = false;
+  bool stream = false;
+  pixelFormat output = PIXEL_RGBA8;
+  for (int32_t i = 1; i < argc; i++) {
+    compress |= strcmp(argv[i], "--compress") == 0;
+    stream |= strcmp(argv[i], "--stream") == 0;
+    if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+      char const* name = argv[++i];
+      if (strcmp(name, "bgra8") == 0)
+        output = PIXEL_BGRA8;
+      else if (strcmp(name, "rgb565") == 0)
+        output = PIXEL_RGB565;
+      else if (strcmp(name, "rgba8") != 0)
+        std::cout << "unknown format " << name << ", using rgba8" << std::endl;
+    }
+  }
+
+  // Untextured light grey until the diffuse map arrives.
+  texel placeholderTexel = {192, 192, 192, 255, 128, 128, 255, 0};
+  material placeholder = {};
+  placeholder.texels = &placeholderTexel;
+  placeholder.x = 1;
+  placeholder.y = 1;
+  placeholder.opacity = 1.f;
+
+  material fallback = {};
+  fallback.opacity = 1.f;
+  resources resources = {};
+  resources.fallback = &fallback;
+  resources.placeholder = &placeholder;
+  resources.compressTextures = compress;
+  pageCache pages = {};
+  if (stream) {
+    pages.texels = (texel*)aligned_alloc(
+        64, (size_t)kResidentPages * kPageTexels * kPageTexels * sizeof(texel));
+    pages.frame = 1;
+    pages.streamer = std::thread(StreamPages, &pages);
+    resources.pages = &pages;
+  }
+  std::thread sceneLoader;
+  std::thread fallbackLoader;
+  LoadResources(&resources, "african_head/african_head.obj", &sceneLoader,
+                &fallbackLoader);
+
+  // Light coming from the viewer.
+  light lights[] = {
+      {LIGHT_DIRECTIONAL, vec3(1), vec3(0), vec3(0, 0, -1), 0.f, 0.f, 0.f,
+       false},
+  };
+  lightSet lightSet = {};
+  SetLights(&lightSet, lights, sizeof(lights) / sizeof(lights[0]));
+
+  frame frame = {};
+  frame.lights = &lightSet;
+  frame.shading = SHADE_FACE;
+  frame.raster = RASTER_AUTO;
+  frame.aoRays = 8;
+  frame.ambientOcclusion = false;
+  frame.ambientOcclusionStrength = 0.8f;
+
+  postChain post = {};
+  post.passes[post.count++] = {POST_TONEMAP, 1.5f, vec3(1)};
+  post.passes[post.count++] = {POST_GAMMA, 1.1f, vec3(1)};
+  post.passes[post.count++] = {POST_GRADE, 1.2f, vec3(1.05f, 1.f, 0.95f)};
+  post.passes[post.count++] = {POST_VIGNETTE, 0.4f, vec3(1)};
+  post.passes[post.count++] = {POST_SHARPEN, 0.25f, vec3(1)};
+  frame.post = &post;
+
+  shadowMap shadowMaps[kMaxShadowMaps] = {};
+  for (int32_t i = 0; i < kMaxShadowMaps; i++) {
+    shadowMaps[i].size = 1024;
+    shadowMaps[i].light = -1;
+    shadowMaps[i].depth = (float*)malloc(shadowMaps[i].size *
+                                         shadowMaps[i].size * sizeof(float));
+  }
+  frame.shadowMaps = shadowMaps;
+  frame.shadowMapCount = kMaxShadowMaps;
+  frame.pcf = 1;
+  frame.exposure = 2;
+
+  screen screen = {};
+  screen.width = 1024;
+  screen.height = 768;
+  screen.depth = 255;
+
+  screen.output = output;
+
+  renderTarget framebuffer = {};
+  CreateRenderTarget(&framebuffer, screen.width, screen.height, PIXEL_RGBA8,
+                     0);
+  screen.framebuffer = &framebuffer;
+  renderTarget hdr = {};
+  CreateRenderTarget(&hdr, screen.width, screen.height, PIXEL_RGBA32F, 0);
+  screen.hdr = &hdr;
+
+  screen.depthbuffer =
+      (float*)malloc(screen.height * screen.width * sizeof(float));
+
+  sampleBuffer samples = {};
+  samples.count = 1;
+  samples.slots =
+      (uint32_t*)malloc(screen.height * screen.width * sizeof(uint32_t));
+  samples.colors = (color*)malloc(screen.height * screen.width * kMaxSamples *
+                                  sizeof(color));
+  samples.depth = (float*)malloc(screen.height * screen.width * kMaxSamples *
+                                 sizeof(float));
+  screen.samples = &samples;
+
+  gBuffer gbuffer = {};
+  gbuffer.normals =
+      (uint32_t*)malloc(screen.height * screen.width * sizeof(uint32_t));
+  gbuffer.albedo = (color*)malloc(screen.height * screen.width * sizeof(color));
+  gbuffer.shininess =
+      (uint8_t*)malloc(screen.height * screen.width * sizeof(uint8_t));
+  screen.gbuffer = &gbuffer;
+
+  oitBuffer oit = {};
+  oit.accum =
+      (float*)malloc(screen.height * screen.width * 4 * sizeof(float));
+  oit.revealage =
+      (float*)malloc(screen.height * screen.width * sizeof(float));
+  for (int32_t i = 0; i < screen.height * screen.width * 4; i++)
+    oit.accum[i] = 0.f;
+  for (int32_t i = 0; i < screen.height * screen.width; i++)
+    oit.revealage[i] = 1.f;
+  screen.oit = &oit;
+
+  // Empty until the first frame, which sizes every arena.
+  frameArenas arenas = {};
+  screen.arenas = &arenas;
+  workerPool workers = {};
+  StartWorkers(&workers);
+  screen.workers = &workers;
+
+  if (benchmark) {
+    sceneLoader.join();
+    fallbackLoader.join();
+    if (resources.sceneState == ASSET_READY)
+      Benchmark(&screen, &resources, &frame, benchmarkFrames);
+    FreeRenderTarget(&framebuffer);
+    FreeRenderTarget(&hdr);
+  } else {
+    SDL_Window* window;
+    SDL_Renderer* renderer;
+    SDL_Texture* texture;
+    Initialize(&window, &renderer, &texture, &screen);
+
+    EventLoop(&screen, &resources, &frame, renderer, texture);
+
+    Destroy(&screen, window, renderer, texture);
+    sceneLoader.join();
+    fallbackLoader.join();
+  }
+  free(screen.depthbuffer);
+  free(samples.slots);
+  free(samples.colors);
+  free(samples.depth);
+  free(gbuffer.normals);
+  free(gbuffer.albedo);
+  free(gbuffer.shininess);
+  free(oit.accum);
+  free(oit.revealage);
+  FreeFrameArenas(&arenas);
+  StopWorkers(&workers);
+  if (pages.streamer.joinable())
+    StopStreamer(&pages);
+  free(pages.texels);
+  FreeTexels(&fallback);
+  for (int32_t i = 0; i < resources.materialCount; i++)
+    FreeTexels(&resources.materials[i]);
+  delete[] resources.materials;
+  for (int32_t i = 0; i < kMaxShadowMaps; i++)
+    free(shadowMaps[i].depth);
 }
 
 void Initialize(SDL_Window** window,
@@ -265,16 +5510,21 @@ void Initialize(SDL_Window** window,
 
   *renderer = SDL_CreateRenderer(*window, -1, 0);
 
-  *texture = SDL_CreateTexture(*renderer, SDL_PIXELFORMAT_RGBA8888,
-                               SDL_TEXTUREACCESS_STREAMING, screen->width,
-                               screen->height);
+  uint32_t format = SDL_PIXELFORMAT_RGBA8888;
+  if (screen->output == PIXEL_BGRA8)
+    format = SDL_PIXELFORMAT_BGRA8888;
+  else if (screen->output == PIXEL_RGB565)
+    format = SDL_PIXELFORMAT_RGB565;
+  *texture = SDL_CreateTexture(*renderer, format, SDL_TEXTUREACCESS_STREAMING,
+                               screen->width, screen->height);
 }
 
 void Destroy(screen* screen,
              SDL_Window* window,
              SDL_Renderer* renderer,
              SDL_Texture* texture) {
-  free(screen->framebuffer);
+  FreeRenderTarget(screen->framebuffer);
+  FreeRenderTarget(screen->hdr);
   SDL_DestroyTexture(texture);
   SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);